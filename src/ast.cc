@@ -1,53 +1,98 @@
 #include "ast.h"
 #include "parser.h"
 
+#include <algorithm>
 #include <set>
+#include <atomic>
+#include <thread>
+#include <unordered_map>
+#include <deque>
+#include <future>
+#include <filesystem>
+#include <condition_variable>
 
 
-std::string SyntaxTree::to_string_int(std::string prefix) const {
+void SyntaxTree::print_node(std::ostream &oss, const std::string &prefix) const {
 	
-	std::ostringstream oss;
 	if (component.is_symbol()) {
 		oss << prefix << "- " << component.id();
-		if (component.id() == "IDENTIFIER") {
+		if (Kind(component.kind()) == Kind::IDENTIFIER) {
 			oss << ": " << first->to_string();
 		}
-		if (component.id() == "STRING_LITERAL" and first->to_string().size()<40) {
+		if (Kind(component.kind()) == Kind::STRING_LITERAL and first->to_string().size()<40) {
 			oss << ": " << first->to_string();
 		}
 
-		if ( not symbols.empty() ) {
+		if (is_lazy) {
+			oss << " (lazy, lines " << first->begin_ptr.get_line() << "-" << (last - 1)->begin_ptr.get_line() << ")";
+		}
+
+		if ( annotations and not annotations->symbols.empty() ) {
 			oss << " [ ";
-			for (auto &s : symbols) 
+			for (auto &s : annotations->symbols) 
 				oss << s.first << " ";
 			oss << "]";
 		}
 
-		if ( not attributes.empty() ) {
+		if ( annotations and not annotations->attributes.empty() ) {
 			oss << " < ";
-			for (auto &s : attributes) 
+			for (auto &s : annotations->attributes) 
 				oss << s.first << " ";
 			oss << ">";
 		}
 
-		if ( not c_type.empty() ) {
-			oss << " T{ " << c_type << " }";
+		if ( annotations and not annotations->c_type.empty() ) {
+			oss << " T{ " << annotations->c_type << " }";
 		}
 
 	} else { // component.is_token()
 		oss << prefix << "- TOKEN: " << component.id();
 	}
-	oss << std::endl;
+	oss << '\n';
+}
+
+// prefix grows and shrinks by one level per node entered and left, so the dump takes linear time.
+void SyntaxTree::print(std::ostream &oss, std::string &prefix) const {
 
-	for (auto &c : children) {
-		oss << prefix + "  |" << std::endl;
+	struct Frame { const SyntaxTree *node; size_t next; };
+	std::vector<Frame> stack(1, { this, 0 });
+
+	print_node(oss, prefix);
+	while (not stack.empty()) {
+
+		auto &top = stack.back();
+		if (top.next == top.node->children.size()) {
+			stack.pop_back();
+			if (not stack.empty()) prefix.resize(prefix.size() - 3);
+			continue;
+		}
+
+		auto &c = top.node->children[top.next++];
+		oss << prefix << "  |\n";
 		if (c) {
-			oss << c->to_string_int(prefix + (&c == &children.back()?"   ":"  |"));
+			prefix += (top.next == top.node->children.size() ? "   " : "  |");
+			c->print_node(oss, prefix);
+			stack.push_back({ c.get(), 0 });
 		} else {
 			oss << "EMPTY CHILD";
 		}
 	}
-	return oss.str();
+}
+
+SyntaxTree::~SyntaxTree() {
+
+	std::vector<SP> pending;
+	auto release = [&pending](std::vector<SP> &nodes) {
+		for (auto &c : nodes)
+			if (c and c.use_count() == 1) pending.push_back(std::move(c));
+	};
+
+	release(children);
+	while (not pending.empty()) {
+		SP node = std::move(pending.back());
+		pending.pop_back();
+		release(node->children);
+	}
 }
 
 std::string SyntaxTree::SP::show_source() const {
@@ -60,14 +105,507 @@ std::string SyntaxTree::SP::show_source() const {
 	return ret;
 }
 
+std::string &SyntaxTree::generated_id() {
+
+	static std::atomic<uint64_t> id = 10000000;
+
+	auto &generated_id = annotate().generated_id;
+	if (generated_id.empty()) 
+		generated_id = "____mc" + std::to_string(id++) + "_";
+	return generated_id;
+}
+
+void SyntaxTree::link_parents(SyntaxTree *root) {
+
+	std::vector<SyntaxTree *> pending(1, root);
+	while (not pending.empty()) {
+		SyntaxTree *node = pending.back();
+		pending.pop_back();
+		for (auto &c : node->children) {
+			if (not c) continue;
+			c->parent = node;
+			pending.push_back(c.get());
+		}
+	}
+}
+
+SyntaxTree::SP SyntaxTree::clone(const SP &root) {
+
+	std::unordered_map<const SyntaxTree *, SP> copies;
+	SP ret = std::make_shared<SyntaxTree>(*root);
+	copies[root.get()] = ret;
+
+	std::vector<SyntaxTree *> pending(1, ret.get());
+	while (not pending.empty()) {
+		SyntaxTree *node = pending.back();
+		pending.pop_back();
+		for (auto &c : node->children) {
+			if (not c) continue;
+			auto &copy = copies[c.get()];
+			if (not copy) {
+				copy = std::make_shared<SyntaxTree>(*c);
+				copy->parent = node;
+				pending.push_back(copy.get());
+			}
+			c = copy;
+		}
+	}
+	return ret;
+}
+
+FlatSyntaxTree::FlatSyntaxTree(const SyntaxTree::SP &root) {
+
+	std::map<std::tuple<std::string, bool, int, bool, bool>, uint16_t> component_index;
+	std::unordered_map<const SyntaxTree *, uint32_t> index;
+
+	auto add = [&](const SyntaxTree *node, uint32_t parent) {
+		auto &c = node->component;
+		auto it = component_index.emplace(std::make_tuple(c.id(), c.is_token(), c.index(), c.force_root, c.must_keep), uint16_t(components.size())).first;
+		if (it->second == components.size()) 
+			components.push_back(c);
+		index[node] = uint32_t(nodes.size());
+		nodes.push_back({ node->first, node->last, parent, 0, 0, it->second, node->is_empty, node->is_lazy });
+	};
+
+	if (not root) return;
+	add(root.get(), none);
+
+	std::vector<const SyntaxTree *> pending(1, root.get());
+	while (not pending.empty()) {
+		const SyntaxTree *node = pending.back();
+		pending.pop_back();
+
+		uint32_t i = index[node];
+		nodes[i].children_begin = uint32_t(children.size());
+		nodes[i].children_count = uint32_t(node->children.size());
+		for (auto &c : node->children) {
+			if (not c) { 
+				children.push_back(none); 
+				continue; 
+			}
+			if (not index.count(c.get())) {
+				add(c.get(), i);
+				pending.push_back(c.get());
+			}
+			children.push_back(index[c.get()]);
+		}
+	}
+}
+
+SyntaxTree::SP FlatSyntaxTree::Node::to_tree() const {
+
+	std::unordered_map<uint32_t, SyntaxTree::SP> copies;
+	auto copy = [&](uint32_t i) {
+		auto &r = tree->nodes[i];
+		auto ret = std::make_shared<SyntaxTree>(r.first, tree->components[r.component], SyntaxTree::SP());
+		ret->last = r.last;
+		ret->is_empty = r.is_empty;
+		ret->is_lazy = r.is_lazy;
+		copies[i] = ret;
+		return ret;
+	};
+
+	SyntaxTree::SP ret = copy(index);
+	std::vector<std::pair<SyntaxTree *, uint32_t>> pending(1, { ret.get(), index });
+	while (not pending.empty()) {
+		auto [node, i] = pending.back();
+		pending.pop_back();
+
+		auto &r = tree->nodes[i];
+		node->children.reserve(r.children_count);
+		for (uint32_t k = r.children_begin; k < r.children_begin + r.children_count; k++) {
+			uint32_t c = tree->children[k];
+			if (c == none) {
+				node->children.emplace_back();
+				continue;
+			}
+			auto it = copies.find(c);
+			if (it == copies.end()) {
+				auto child = copy(c);
+				child->parent = node;
+				pending.emplace_back(child.get(), c);
+				node->children.push_back(child);
+			} else {
+				node->children.push_back(it->second);
+			}
+		}
+	}
+	return ret;
+}
+
+SyntaxTree::TI SyntaxTree::matching_delimiter(TI it) {
+
+	auto &file = it->begin_ptr.get_file();
+	if (not file.tokens or not file.matching_delimiters) return it;
+
+	// it may point into a token vector other than the file's (e.g., the new tokens of a reparse).
+	const std::vector<Token> &tokens = *file.tokens;
+	if (std::less<const Token *>()(&*it, tokens.data()) or not std::less<const Token *>()(&*it, tokens.data() + tokens.size())) return it;
+
+	size_t i = &*it - tokens.data();
+	return it + (ptrdiff_t((*file.matching_delimiters)[i]) - ptrdiff_t(i));
+}
+
+// True if a '}' at index i closes a statement: a block, a function or namespace body, but not a struct or union body, 
+// nor an initializer, which the declaration continues after.
+static bool closes_statement(const std::vector<Token> &tokens, const std::vector<size_t> &matching_delimiters, size_t i) {
+
+	size_t open = matching_delimiters[i];
+	if (open == 0) return true;
+
+	auto &before = tokens[open - 1];
+	if (before.literal == "=" or before.literal == "struct" or before.literal == "union") return false;
+
+	// '>' closes either the attribute section of a function, or the parameters of a generic struct.
+	if (before.literal == ">") {
+		for (size_t j = open - 1; j-- > 0; ) {
+			if (tokens[j].type == Token::PUNCTUATOR and matching_delimiters[j] < j) j = matching_delimiters[j];
+			else if (tokens[j].literal == "<") return j == 0 or tokens[j - 1].literal != "struct";
+		}
+	}
+	return true;
+}
+
+// True if a statement can start at t, and nothing before it can continue into it.
+static bool starts_statement(const Token &t) {
+
+	if (t.type != Token::PUNCTUATOR) return t.literal != "else" and t.literal != "while";
+
+	static const std::set<std::string> starters = { "{", "(", "*", "&", "-", "+", "!", "~", "++", "--", "%" };
+	return starters.count(t.literal);
+}
+
+// Splits the token vector at top-level statement boundaries: after a ';' or a '}' that closes a statement at depth 0, 
+// and only before a token that can start the next one. 'else' and 'while' are never split from what precedes them.
+static std::vector<SyntaxTree::TI> top_level_boundaries(const std::vector<Token> &tokens, const std::vector<size_t> &matching_delimiters, size_t min_chunk_size) {
+
+	std::vector<SyntaxTree::TI> boundaries(1, tokens.begin());
+
+	for (size_t i = 0; i < tokens.size(); i++) {
+
+		if (tokens[i].type != Token::PUNCTUATOR) continue;
+		
+		// skip bracketed regions as a whole, landing on their closer.
+		if (matching_delimiters[i] > i) i = matching_delimiters[i];
+
+		auto it = tokens.begin() + i;
+		if (it->literal != ";" and it->literal != "}") continue;
+
+		auto next = it + 1;
+		if (next == tokens.end()) break;
+		if (not starts_statement(*next)) continue;
+		if (it->literal == "}" and not closes_statement(tokens, matching_delimiters, i)) continue;
+
+		if (size_t(next - boundaries.back()) >= min_chunk_size) 
+			boundaries.push_back(next);
+	}
+	boundaries.push_back(tokens.end());
+	return boundaries;
+}
+
+// Parses [begin, end) as a translation_unit. Returns an empty SP if no candidate, or more than one, spans the whole range.
+static SyntaxTree::SP parse_translation_unit(SyntaxTree::TI begin, SyntaxTree::TI end, std::shared_ptr<ParseBudget> budget) {
+
+	ParseDebug debug; 
+	debug.last_error_token = begin;
+	debug.budget = budget;
+
+	std::vector<SyntaxTree::SP> all_ast;
+	try {
+		all_ast = parse(begin, end, Grammar::Symbol::Component::Symbol("translation_unit"), debug);
+	} catch (ParseBudgetExceeded &e) {
+		Log(ERROR) << e.describe();
+	}
+
+	SyntaxTree::SP ret;
+	for (auto &ast : all_ast) {
+		if (ast->last != end) continue;
+		if (ret) return SyntaxTree::SP();
+		ret = ast;
+	}
+	if (ret) SyntaxTree::link_parents(ret.get());
+	return ret;
+}
+
+// Parses each chunk as a translation_unit on its own thread, and stitches the statements together in order.
+// Returns an empty SP if any chunk fails or is ambiguous, so the caller can fall back to a serial parse that reports the error.
+static SyntaxTree::SP parse_in_chunks(const std::vector<Token> &tokens, const std::vector<size_t> &matching_delimiters, size_t n_threads, std::shared_ptr<ParseBudget> budget) {
+
+	auto boundaries = top_level_boundaries(tokens, matching_delimiters, tokens.size() / (4 * n_threads) + 1);
+	size_t n_chunks = boundaries.size() - 1;
+	if (n_chunks < 2) return SyntaxTree::SP();
+
+	std::vector<SyntaxTree::SP> chunks(n_chunks);
+	std::vector<std::exception_ptr> errors(n_chunks);
+	std::atomic<size_t> next_chunk = 0;
+	
+	auto worker = [&]() {
+		for (size_t i = next_chunk++; i < n_chunks; i = next_chunk++) {
+			try {
+				chunks[i] = parse_translation_unit(boundaries[i], boundaries[i+1], budget);
+			} catch (...) {
+				errors[i] = std::current_exception();
+			}
+			if (not chunks[i]) next_chunk = n_chunks;
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (size_t t = 1; t < std::min(n_threads, n_chunks); t++) 
+		threads.emplace_back(worker);
+	worker();
+	for (auto &t : threads) 
+		t.join();
+
+	for (auto &e : errors) 
+		if (e) std::rethrow_exception(e);
+
+	for (auto &chunk : chunks) 
+		if (not chunk) return SyntaxTree::SP();
+
+	Log(INFO) << "Parsed " << tokens.size() << " tokens in " << n_chunks << " chunks";
+
+	SyntaxTree::SP root = std::make_shared<SyntaxTree>(tokens.begin(), Grammar::Symbol::Component::Symbol("translation_unit"), SyntaxTree::SP());
+	root->last = tokens.end();
+	for (auto &chunk : chunks) {
+		for (auto &c : chunk->children) {
+			c->parent = root;
+			root->children.push_back(c);
+		}
+	}
+	return root;
+}
+
+void SyntaxTree::SP::expand() {
+
+	auto &ast = *this;
+	if (not ast or not ast->is_lazy) return;
+	ast->is_lazy = false;
+
+	// Only function bodies are lazy. Their braces are not kept: a function_body holds the translation_unit between them, if any.
+	auto begin = ast->first + 1, end = ast->last - 1;
+	if (begin != end) {
+
+		auto body = parse_translation_unit(begin, end, ParseBudget::create());
+		if (not body) 
+			ast.log(ERROR) << "Parser failed in function body";
+
+		body->parent = ast;
+		ast->children.push_back(body);
+	}
+
+	Log(INFO) << "Expanded " << ast.id() << " in line " << ast->first->begin_ptr.get_line();
+
+	for (auto &pass : completed_passes())
+		pass(ast);
+}
+
+// Moves a subtree parsed over old_tokens onto new_tokens, shifting the tokens that follow the edit by delta.
+static void remap_tokens(SyntaxTree::SP &ast, const std::vector<Token> &old_tokens, const std::vector<Token> &new_tokens, size_t old_edit_last, ptrdiff_t delta) {
+
+	auto remap = [&](SyntaxTree::TI it) {
+		size_t idx = it - old_tokens.begin();
+		if (idx >= old_edit_last) idx += delta;
+		return new_tokens.begin() + idx;
+	};
+
+	std::vector<SyntaxTree *> pending(1, ast.get());
+	while (not pending.empty()) {
+		SyntaxTree *node = pending.back();
+		pending.pop_back();
+		node->first = remap(node->first);
+		node->last = remap(node->last);
+		for (auto &c : node->children) 
+			if (c) pending.push_back(c.get());
+	}
+}
+
+// The top-level statements [first, last) of a translation_unit to parse again after an edit of its tokens [edit_first, edit_last).
+// Statement i spans from the end of statement i-1 to its own end (empty statements and opening braces of collapsed
+// blocks live in between). These are the statements that overlap the edit, plus one neighbour on each side, 
+// as their follow context (e.g., an 'else' after an 'if') or their closing token may have changed.
+static std::pair<size_t, size_t> statements_around(const std::vector<SyntaxTree::SP> &statements, SyntaxTree::TI first_token, size_t edit_first, size_t edit_last) {
+
+	auto end_of = [&](size_t i) { return size_t(statements[i]->last - first_token); };
+
+	size_t first = 0;
+	while (first < statements.size() and end_of(first) <= edit_first) 
+		first++;
+	
+	size_t last = first;
+	while (last < statements.size() and end_of(last) < edit_last) 
+		last++;
+
+	if (first > 0) first--;
+	return { first, std::min(last + 2, statements.size()) };
+}
+
+SyntaxTree::SP SyntaxTree::reparse(SP old_ast, const std::vector<Token> &old_tokens, const std::vector<Token> &new_tokens, size_t edit_first, size_t old_edit_last, size_t new_edit_last) {
+
+	ptrdiff_t delta = ptrdiff_t(new_edit_last) - ptrdiff_t(old_edit_last);
+	auto budget = ParseBudget::create();
+
+	auto full_parse = [&]() {
+		auto ast = parse_translation_unit(new_tokens.begin(), new_tokens.end(), budget);
+		if (not ast) Log(ERROR) << "Incremental reparse failed to parse the edited file";
+		return ast;
+	};
+
+	if (not old_ast or old_ast.id() != "translation_unit" or old_ast->first != old_tokens.begin() or old_ast->last != old_tokens.end()) 
+		return full_parse();
+
+	auto &statements = old_ast->children;
+	auto end_of = [&](size_t i) { return size_t(statements[i]->last - old_tokens.begin()); };
+
+	auto [reparse_first, reparse_last] = statements_around(statements, old_tokens.begin(), edit_first, old_edit_last);
+
+	size_t old_first = (reparse_first == 0 ? 0 : end_of(reparse_first - 1));
+	size_t old_last = (reparse_last == statements.size() ? old_tokens.size() : end_of(reparse_last - 1));
+
+	SP reparsed;
+	if (old_first != old_last + delta) {
+		reparsed = parse_translation_unit(new_tokens.begin() + old_first, new_tokens.begin() + (old_last + delta), budget);
+		if (not reparsed) return full_parse();
+	}
+
+	Log(INFO) << "Reparsed " << (reparse_last - reparse_first) << " of " << statements.size() << " statements";
+
+	SP root = std::make_shared<SyntaxTree>(new_tokens.begin(), Grammar::Symbol::Component::Symbol("translation_unit"), SP());
+	root->last = new_tokens.end();
+
+	for (size_t i = 0; i < reparse_first; i++) 
+		root->children.push_back(statements[i]);
+	if (reparsed) 
+		for (auto &c : reparsed->children) 
+			root->children.push_back(c);
+	for (size_t i = reparse_last; i < statements.size(); i++) 
+		root->children.push_back(statements[i]);
+
+	if (root->children.empty()) 
+		return full_parse();
+
+	for (size_t i = 0; i < reparse_first; i++) 
+		remap_tokens(statements[i], old_tokens, new_tokens, old_edit_last, delta);
+	for (size_t i = reparse_last; i < statements.size(); i++) 
+		remap_tokens(statements[i], old_tokens, new_tokens, old_edit_last, delta);
+	
+	for (auto &c : root->children)
+		c->parent = root;
+
+	return root;
+}
+
+SyntaxTree::SP SyntaxTree::reparse(SP old_ast, SourceFile &old_file, SourceFile &new_file, size_t edit_begin, size_t old_edit_end, size_t new_edit_end) {
+
+	auto &old_tokens = tokenize(old_file);
+	if (new_file.tokens or not old_ast or old_ast.id() != "translation_unit" or old_ast->first != old_tokens.begin() or old_ast->last != old_tokens.end()) 
+		return std::make_shared<SyntaxTree>(new_file);
+
+	// Byte offsets of the first character of a token, and of the character after it.
+	auto begin_of = [](const Token &t) { return size_t(t.begin_ptr.position().offset) - 1; };
+	auto end_of = [](const Token &t) { return size_t(t.end_ptr.position().offset) - 1; };
+	ptrdiff_t byte_delta = ptrdiff_t(new_edit_end) - ptrdiff_t(old_edit_end);
+
+	// The tokens the edit touches, including those it ends or starts next to, which it may extend.
+	size_t edit_first = std::partition_point(old_tokens.begin(), old_tokens.end(), [&](const Token &t) { return end_of(t) < edit_begin; }) - old_tokens.begin();
+	size_t edit_last = std::partition_point(old_tokens.begin(), old_tokens.end(), [&](const Token &t) { return begin_of(t) <= old_edit_end; }) - old_tokens.begin();
+
+	// Only the statements around the edit are tokenized again, from the end of the token before them, where no delimiter is open. 
+	auto &statements = old_ast->children;
+	auto [reparse_first, reparse_last] = statements_around(statements, old_tokens.begin(), edit_first, edit_last);
+	size_t old_first = (reparse_first == 0 ? 0 : statements[reparse_first - 1]->last - old_tokens.begin());
+	size_t old_last = (reparse_last == statements.size() ? old_tokens.size() : statements[reparse_last - 1]->last - old_tokens.begin());
+
+	NormalizedSourcePtr p(new_file);
+	if (old_first == 0 and p.starts_with("\xef\xbb\xbf")) p += 3;
+	if (old_first > 0) p = NormalizedSourcePtr(new_file, old_tokens[old_first - 1].end_ptr.position());
+
+	std::vector<Token> region;
+	size_t stop = (old_last == old_tokens.size() ? new_file.source->size() + 1 : begin_of(old_tokens[old_last]) + byte_delta);
+	auto next = tokenize_until(p, stop, false, old_first == 0, region);
+
+	// The tokens after the region are those of the old file if the edit did not change where the first of them starts, nor how 
+	// (e.g., by opening a comment that hides it). Otherwise, the whole file is parsed again.
+	if (old_last != old_tokens.size()) {
+		auto &old_next = old_tokens[old_last];
+		if (not next or begin_of(*next) != stop or next->type != old_next.type or next->literal != old_next.literal or next->val != old_next.val or 
+			next->has_space != old_next.has_space or next->start_of_line != old_next.start_of_line) 
+			return std::make_shared<SyntaxTree>(new_file);
+	}
+
+	// Positions are moved to the new file. Those after the region are shifted by the bytes and lines the edit added: 
+	// the line where the region ends starts where it does in the new file, the following ones byte_delta further than they did.
+	size_t next_line = (next ? old_tokens[old_last].begin_ptr.get_line() : 0);
+	ptrdiff_t line_delta = (next ? ptrdiff_t(next->begin_ptr.get_line()) - ptrdiff_t(next_line) : 0);
+	uint32_t next_line_offset = (next ? next->begin_ptr.position().line_offset : 0);
+	auto moved = [&](const NormalizedSourcePtr &ptr, bool shifted) {
+		auto position = ptr.position();
+		if (shifted) {
+			position.line_offset = (position.line == next_line ? next_line_offset : position.line_offset + byte_delta);
+			position.offset += byte_delta;
+			position.line += line_delta;
+		}
+		return NormalizedSourcePtr(new_file, position);
+	};
+
+	auto tokens_ptr = std::make_shared<std::vector<Token>>();
+	auto matching_ptr = std::make_shared<std::vector<size_t>>(old_tokens.size() + region.size() - (old_last - old_first));
+	std::vector<Token> &tokens = *tokens_ptr;
+	std::vector<size_t> &matching = *matching_ptr;
+	tokens.reserve(matching.size());
+
+	auto &old_matching = *old_file.matching_delimiters;
+	ptrdiff_t token_delta = ptrdiff_t(region.size()) - ptrdiff_t(old_last - old_first);
+	for (size_t i = 0; i < old_first; i++) {
+		tokens.push_back(old_tokens[i]);
+		tokens.back().begin_ptr = moved(old_tokens[i].begin_ptr, false);
+		tokens.back().end_ptr = moved(old_tokens[i].end_ptr, false);
+		matching[i] = old_matching[i];
+	}
+	for (auto &t : region) 
+		tokens.push_back(std::move(t));
+	match_delimiters(tokens, old_first, tokens.size(), matching);
+	for (size_t i = old_last; i < old_tokens.size(); i++) {
+		tokens.push_back(old_tokens[i]);
+		tokens.back().begin_ptr = moved(old_tokens[i].begin_ptr, true);
+		tokens.back().end_ptr = moved(old_tokens[i].end_ptr, true);
+		matching[i + token_delta] = old_matching[i] + token_delta;
+	}
+
+	new_file.tokens = tokens_ptr;
+	new_file.matching_delimiters = matching_ptr;
+	return reparse(std::move(old_ast), old_tokens, tokens, edit_first, edit_last, edit_last + token_delta);
+}
+
 SyntaxTree::SyntaxTree(SourceFile &file) {
 
 	auto &tokens = tokenize(file);
+	IncludedFiles::prefetch(file);
+	auto budget = ParseBudget::create();
+
+	if (ParseOptions::threads() > 1 and tokens.size() >= ParseOptions::min_tokens_per_thread() * 2) {
+
+		size_t n_threads = std::min(ParseOptions::threads(), tokens.size() / ParseOptions::min_tokens_per_thread());
+		auto ast = parse_in_chunks(tokens, *file.matching_delimiters, n_threads, budget);
+		if (ast) {
+			*this = *ast;
+			for (auto &c : children) 
+				c->parent = this;
+			return;
+		}
+		Log(INFO) << "Parallel parse of " << file.path << " failed, falling back to a serial parse";
+	}
 	
 	ParseDebug debug; 
 	debug.last_error_token = tokens.begin();
+	debug.budget = budget;
 	Grammar::Symbol::Component start_symbol; start_symbol = Grammar::Symbol::Component::Symbol("start");
-	auto all_ast = parse(tokens.begin(), tokens.end(), start_symbol, debug);
+	std::vector<SP> all_ast;
+	try {
+		all_ast = parse(tokens.begin(), tokens.end(), start_symbol, debug);
+	} catch (ParseBudgetExceeded &e) {
+		Log(ERROR) << e.describe();
+	}
 	
 	if (all_ast.empty()) {
 
@@ -108,6 +646,115 @@ SyntaxTree::SyntaxTree(SourceFile &file) {
 		}
 
 		for (auto &ast : all_ast) if (ast->last == last_token) *this = *ast;
+		link_parents(this);
 	}
 }
 	
+
+
+
+/////////////////////////////////////////////////////////////////
+// INCLUDED FILES
+// Whoever gets to a file first parses it: a worker, or the Preprocessor if the worker did not start yet, so it never waits for the queue.
+struct IncludedFile {
+	std::packaged_task<std::shared_ptr<const FlatSyntaxTree>()> parse;
+	std::shared_future<std::shared_ptr<const FlatSyntaxTree>> tree;
+	std::atomic<bool> started = false;
+
+	IncludedFile(const std::string &path) : 
+		parse([path] { return std::make_shared<const FlatSyntaxTree>(std::make_shared<SyntaxTree>(SourceFile::Manager::get(path))); }), 
+		tree(parse.get_future()) {}
+
+	void run() { if (not started.exchange(true)) parse(); }
+};
+
+// Queued parses not started by the end of the compile are dropped.
+struct IncludeWorkers {
+	std::mutex mtx;
+	std::condition_variable ready;
+	std::deque<std::shared_ptr<IncludedFile>> queue;
+	std::vector<std::thread> threads;
+	bool stopping = false;
+
+	void push(std::shared_ptr<IncludedFile> file) {
+
+		std::lock_guard<std::mutex> lock(mtx);
+		queue.push_back(file);
+		if (threads.size() < ParseOptions::include_threads() and threads.size() < queue.size()) 
+			threads.emplace_back([this] { work(); });
+		ready.notify_one();
+	}
+
+	void work() {
+
+		while (true) {
+			std::shared_ptr<IncludedFile> file;
+			{
+				std::unique_lock<std::mutex> lock(mtx);
+				ready.wait(lock, [this] { return stopping or not queue.empty(); });
+				if (stopping) return;
+				file = queue.front();
+				queue.pop_front();
+			}
+			// Errors are kept in the future, and reported by get().
+			file->run();
+		}
+	}
+
+	~IncludeWorkers() {
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			stopping = true;
+		}
+		ready.notify_all();
+		for (auto &t : threads) 
+			t.join();
+	}
+
+	static IncludeWorkers &global() { static IncludeWorkers workers; return workers; }
+};
+
+static std::mutex &included_files_mutex() { static std::mutex mtx; return mtx; }
+
+static std::map<std::string, std::shared_ptr<IncludedFile>> &included_files() { static std::map<std::string, std::shared_ptr<IncludedFile>> files; return files; }
+
+std::string IncludedFiles::path(const SourceFile &from, const std::string &name) {
+
+	return std::filesystem::weakly_canonical(std::filesystem::path(from.path).parent_path() / name);
+}
+
+std::shared_ptr<const FlatSyntaxTree> IncludedFiles::get(const std::string &path) {
+
+	std::shared_ptr<IncludedFile> file;
+	{
+		std::lock_guard<std::mutex> lock(included_files_mutex());
+		auto &f = included_files()[path];
+		if (not f) f = std::make_shared<IncludedFile>(path);
+		file = f;
+	}
+	file->run();
+	return file->tree.get();
+}
+
+void IncludedFiles::prefetch(const SourceFile &file) {
+
+	if (not ParseOptions::include_threads() or not file.tokens) return;
+
+	auto &tokens = *file.tokens;
+	for (size_t i = 0; i + 1 < tokens.size(); i++) {
+
+		if (tokens[i].type != Token::IDENTIFIER or tokens[i].literal != "include" or tokens[i + 1].type != Token::STRING_LITERAL) continue;
+
+		std::string included_path = path(file, tokens[i + 1].literal);
+		if (not std::filesystem::exists(included_path)) continue; // reported by the Preprocessor, if it gets to it
+
+		std::shared_ptr<IncludedFile> included;
+		{
+			std::lock_guard<std::mutex> lock(included_files_mutex());
+			auto &f = included_files()[included_path];
+			if (f) continue;
+			included = f = std::make_shared<IncludedFile>(included_path);
+		}
+		IncludeWorkers::global().push(included);
+	}
+}
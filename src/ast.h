@@ -1,10 +1,17 @@
 #pragma once
 #include <tokenizer.h>
 #include <grammar.h>
+#include <grammar_kinds.h>
 
-struct SyntaxTree {
+#include <atomic>
+#include <functional>
+
+struct Type;
+
+struct SyntaxTree : std::enable_shared_from_this<SyntaxTree> {
 private:
-	std::string to_string_int(std::string) const;
+	void print(std::ostream &os, std::string &prefix) const;
+	void print_node(std::ostream &os, const std::string &prefix) const;
 public:
 
 
@@ -17,17 +24,22 @@ public:
 
 		SyntaxTree::SP &operator[](size_t i) { 
 			auto &ast = *this;
+			expand();
 			if ( ast->children.size() > i ) return ast->children[i]; 
 			Log(ERROR) << "Children " << i << " not found in " << id() << ". \n" << show_source(); throw;
 		}
 
+		// Prefer the typed views of grammar_views.h, which know the index of each child.
 		SyntaxTree::SP &operator[](std::string s) { 
 			auto &ast = *this;
-			for (auto &c : ast->children) if (c and c.id()==s ) return c; 
+			expand();
+			uint16_t k = Grammar::kind_of(s);
+			for (auto &c : ast->children) if (c and (k ? c->component.kind()==k : c.id()==s) ) return c; 
 			Log(ERROR) << s << " not found in " << id() << ". \n" << show_source(); throw;
 		}
 
 		std::string id() const { return get()->component.id(); }
+		Kind kind() const { return Kind(get()->component.kind()); }
 		std::string literal() const {return get()->first->literal; }
 
 		struct GLog {
@@ -39,8 +51,28 @@ public:
 		};
 
 		GLog log(LogLevel l) const { return GLog(l, *this); };
-		std::string to_string(std::string prefix = "") const { const auto &ast = *this; return ast->to_string_int(prefix); };
+		std::string to_string(std::string prefix = "") const { std::ostringstream oss; dump(oss, prefix); return oss.str(); };
+		void dump(std::ostream &os, std::string prefix = "") const { const auto &ast = *this; ast->print(os, prefix); };
 		std::string show_source() const;
+
+		// Parses a lazy node, and replays the completed passes on it. Does nothing on nodes that are already parsed.
+		void expand();
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// Parents are not owned: an owning parent made every node a reference cycle with its children, 
+	// so neither the parsed trees nor the candidates discarded while parsing were ever freed.
+	struct ParentRef {
+		SyntaxTree *ptr = nullptr;
+
+		ParentRef() {}
+		ParentRef(SyntaxTree *p) : ptr(p) {}
+		ParentRef(const std::shared_ptr<SyntaxTree> &sp) : ptr(sp.get()) {}
+
+		operator SP() const { return ptr ? SP(ptr->shared_from_this()) : SP(); }
+		SyntaxTree *operator->() const { return ptr; }
+		explicit operator bool() const { return ptr != nullptr; }
+		std::string id() const { return ptr->component.id(); }
 	};
 
 	using TI = std::vector<Token>::const_iterator;
@@ -49,21 +81,156 @@ public:
 
 	Grammar::Symbol::Component component;
 
-	SP old;
-	SP parent;
+	ParentRef parent;
 	std::vector<SP> children;
 
 	bool is_empty = false;
+	bool is_lazy = false; // only the token range is known, see ParseOptions::lazy_function_bodies()
+
+	// Structural hash of a pure expression, 0 if the node is not one. Set by the HashConsing pass, see generator.cc
+	uint32_t hash = 0;
 	
 	SyntaxTree(TI _first, Grammar::Symbol::Component _component, SP _parent) : first(_first), last(++ _first), component(_component), parent(_parent) {}
 
 	SyntaxTree(SourceFile &file);
+
+	// Frees the subtrees it solely owns one node at a time, as a chain of destructors would overflow the stack on deep trees.
+	~SyntaxTree();
+
+	// Points the parent of every node below root at the node that holds it. Parsing shares subtrees between candidates, 
+	// so the parents of a freshly parsed tree may refer to candidates that no longer exist.
+	static void link_parents(SyntaxTree *root);
+
+	// Copies the nodes of a tree, so passes can rewrite the copy and leave the original as it is. Shared subtrees stay shared; 
+	// tokens are those of the original. The root keeps the parent of the original, the other nodes point at their copied parents.
+	static SP clone(const SP &root);
+
+	// Depth first walk with an explicit stack, so its depth is not bounded by the call stack.
+	// pre is called on a node before its children, and may replace it through the slot it gets: the children walked are those of the replacement.
+	// post is called on the slot of a node after its children, and may replace it as well. Empty children are skipped.
+	template<typename Pre, typename Post>
+	static void traverse(SP &root, Pre &&pre, Post &&post) {
+
+		struct Frame { SyntaxTree *node; size_t next; };
+		std::vector<Frame> stack;
+
+		pre(root);
+		if (root) stack.push_back({ root.get(), 0 });
+		while (not stack.empty()) {
+
+			auto &top = stack.back();
+			if (top.next < top.node->children.size()) {
+				SP &c = top.node->children[top.next++];
+				if (not c) continue;
+				pre(c);
+				if (c) stack.push_back({ c.get(), 0 });
+				continue;
+			}
+
+			// The slot is looked up again, the vector that holds it may have grown since.
+			stack.pop_back();
+			post(stack.empty() ? root : stack.back().node->children[stack.back().next - 1]);
+		}
+	}
+
+	template<typename Pre>
+	static void traverse(SP &root, Pre &&pre) { traverse(root, pre, [](SP &) {}); }
+
+	// Incremental reparse for editors and watch mode: old_tokens[edit_first, old_edit_last) were replaced by new_tokens[edit_first, new_edit_last).
+	// Top-level statements of old_ast outside the edit are moved into the returned tree (old_ast must be a freshly parsed translation_unit, 
+	// and is consumed); only the statements around the edit are parsed again.
+	static SP reparse(SP old_ast, const std::vector<Token> &old_tokens, const std::vector<Token> &new_tokens, size_t edit_first, size_t old_edit_last, size_t new_edit_last);
+
+	// The same, for new_file as old_file (whose tree is old_ast) with the bytes [edit_begin, old_edit_end) replaced by [edit_begin, new_edit_end) of new_file.
+	// Only the statements around the edit are tokenized again; the tokens of new_file before and after them are those of old_file, moved.
+	// new_file must not be tokenized yet.
+	static SP reparse(SP old_ast, SourceFile &old_file, SourceFile &new_file, size_t edit_begin, size_t old_edit_end, size_t new_edit_end);
+
+	// The delimiter matching it (see tokenize()), or it if there is none.
+	static TI matching_delimiter(TI it);
+
+	// Passes already applied to the tree, in order. They are replayed on lazy nodes when these are expanded.
+	static std::vector<std::function<void(SP &)>> &completed_passes() { static std::vector<std::function<void(SP &)>> passes; return passes; }
 	
-	// filled during code generation:
-	std::map<std::string, SyntaxTree::SP> symbols;
-	std::map<std::string, SyntaxTree::SP> attributes;
-	SyntaxTree::SP type; 
-	std::string c_type;
-	std::string generated_id = [](){static uint64_t id = 10000000; return "____mc" + std::to_string(id++) + "_";}();
+	///////////////////////////////////////////////////////////////////////////
+	// Filled during code generation. Only a few nodes get any, so they are allocated on first access.
+	struct Annotations {
+		SP old; // the node this one replaced
+		std::map<std::string, SyntaxTree::SP> symbols;
+		std::map<std::string, SyntaxTree::SP> attributes;
+		SyntaxTree::SP type; 
+		const Type *resolved_type = nullptr; // interned, see types.h
+		std::string c_type;
+		std::string generated_id;
+	};
+
+	// Copies of a node get their own copy of its annotations.
+	struct AnnotationsPtr : std::unique_ptr<Annotations> {
+		AnnotationsPtr() {}
+		AnnotationsPtr(const AnnotationsPtr &a) : std::unique_ptr<Annotations>(a ? std::make_unique<Annotations>(*a) : nullptr) {}
+		AnnotationsPtr &operator=(const AnnotationsPtr &a) { reset(a ? new Annotations(*a) : nullptr); return *this; }
+	};
+	AnnotationsPtr annotations;
+
+	Annotations &annotate() { if (not annotations) annotations.reset(new Annotations()); return *annotations; }
+
+	SP &old() { return annotate().old; }
+	std::map<std::string, SyntaxTree::SP> &symbols() { return annotate().symbols; }
+	std::map<std::string, SyntaxTree::SP> &attributes() { return annotate().attributes; }
+	SyntaxTree::SP &type() { return annotate().type; }
+	const Type *&resolved_type() { return annotate().resolved_type; }
+	std::string &c_type() { return annotate().c_type; }
+
+	// Unique C identifier of the node, numbered in order of first use.
+	std::string &generated_id();
 };
 
+
+///////////////////////////////////////////////////////////////////////////
+// FLAT SYNTAX TREES
+// A read-only copy of a tree in one arena: the nodes in a contiguous array, the children of each as a span of node indices, 
+// and the parent of each as an index. Trees that are kept for the whole compile but never rewritten (the parsed included files, 
+// see IncludedFiles) are stored this way, and passes rewrite SP copies of them, see Node::to_tree.
+struct FlatSyntaxTree {
+
+	static constexpr uint32_t none = ~uint32_t(0);
+
+	struct Record {
+		SyntaxTree::TI first, last;
+		uint32_t parent, children_begin, children_count;
+		uint16_t component; // index in components
+		bool is_empty, is_lazy;
+	};
+
+	std::vector<Record> nodes; // the root is nodes[0]
+	std::vector<uint32_t> children; // node indices, none for empty children
+	std::vector<Grammar::Symbol::Component> components; // each distinct component once
+
+	// Reads like an SP, for the few places that look into the tree before copying it.
+	struct Node {
+		const FlatSyntaxTree *tree = nullptr;
+		uint32_t index = none;
+
+		explicit operator bool() const { return index != none; }
+		const Record &record() const { return tree->nodes[index]; }
+		const Grammar::Symbol::Component &component() const { return tree->components[record().component]; }
+
+		std::string id() const { return component().id(); }
+		Kind kind() const { return Kind(component().kind()); }
+		std::string literal() const { return record().first->literal; }
+
+		size_t size() const { return record().children_count; }
+		Node operator[](size_t i) const { 
+			if (i >= size()) Log(ERROR) << "Children " << i << " not found in " << id() << ". \n" << record().first->show_source();
+			return { tree, tree->children[record().children_begin + i] }; 
+		}
+		Node parent() const { return { tree, record().parent }; }
+
+		// A copy of the subtree as SyntaxTree nodes. Shared subtrees stay shared, the root has no parent.
+		SyntaxTree::SP to_tree() const;
+	};
+
+	Node root() const { return { this, nodes.empty() ? none : 0 }; }
+
+	explicit FlatSyntaxTree(const SyntaxTree::SP &root);
+};
@@ -5,6 +5,8 @@
 #include <string>
 #include <vector>
 #include <iomanip>
+#include <map>
+#include <mutex>
 
 #include "log.h"
 
@@ -16,6 +18,8 @@ struct SourceFile {
 	std::string path;
 	std::shared_ptr<std::string> source;
 	std::shared_ptr<std::vector<Token>> tokens;
+	std::shared_ptr<std::vector<size_t>> matching_delimiters; // filled by tokenize(), see there
+	std::vector<std::shared_ptr<const std::vector<Token>>> saved_tokens; // of the trees loaded with only some of its tokens, see load_syntax_tree
 	
 	SourceFile(std::string _path) : path(_path) {
 			
@@ -39,29 +43,35 @@ struct SourceFile {
 
 	SourceFile(std::string name, const std::string_view &content) : path(name), source(std::make_shared<std::string>(content)) {}
 
+	// Files may be loaded from several threads, see IncludedFiles. They are read outside of the lock.
 	class Manager {
 		
 		static std::map<std::string, SourceFile> &storage() {
 			static std::map<std::string, SourceFile> st;
 			return st;
 		}
+
+		static std::mutex &mutex() { static std::mutex mtx; return mtx; }
+
+		template<typename... Args>
+		static SourceFile &get_or_load(const std::string &path, const Args &...args) {
+
+			{
+				std::lock_guard<std::mutex> lock(mutex());
+				auto it = storage().find(path);
+				if (it != storage().end()) return it->second;
+			}
+
+			SourceFile file(path, args...);
+
+			std::lock_guard<std::mutex> lock(mutex());
+			return storage().emplace(path, std::move(file)).first->second;
+		}
 	public:
 		
-		static SourceFile &get( std::string path ) {
-			
-			if (storage().count(path) == 0)	
-				storage().emplace(path, SourceFile(path) );
-			
-			return storage().at(path);
-		}
+		static SourceFile &get( std::string path ) { return get_or_load(path); }
 
-		static SourceFile &get( std::string path, const std::string_view &content ) {
-			
-			if (storage().count(path) == 0)	
-				storage().emplace(path, SourceFile(path, content) );
-			
-			return storage().at(path);
-		}
+		static SourceFile &get( std::string path, const std::string_view &content ) { return get_or_load(path, content); }
 	};
 };
 
@@ -84,6 +94,9 @@ class NormalizedSourcePtr {
 
 	public:
 		SourcePtr(const SourceFile &source_file) : src(source_file.source.get()), it(src->begin()) {} 
+		SourcePtr(const SourceFile &source_file, size_t offset) : src(source_file.source.get()), it(src->begin() + offset) {} 
+
+		size_t offset() const { return it - src->begin(); }
 
 		bool starts_with(std::string s) const { return Utilities::starts_with(*this, s); }
 
@@ -117,6 +130,13 @@ public:
 	NormalizedSourcePtr(const SourceFile &source_file) : 
 		source_file_ptr(&source_file), start_line(*source_file_ptr), it(*source_file_ptr) { ++(*this); }
 
+	// Saves the pointer, to restore it later without walking the file again (see serialize.h).
+	struct Position { uint32_t offset, line_offset, line; char c; };
+	Position position() const { return { uint32_t(it.offset()), uint32_t(start_line.offset()), uint32_t(line), c }; }
+
+	NormalizedSourcePtr(const SourceFile &source_file, const Position &p) : 
+		c(p.c), source_file_ptr(&source_file), start_line(source_file, p.line_offset), it(source_file, p.offset), line(p.line) {}
+
 	char operator*() const { return c; }
 
 	NormalizedSourcePtr operator++(int) { auto tmp = *this; ++(*this); return tmp; }
@@ -1,6 +1,15 @@
 #include "generator.h"
+#include "parser.h"
+#include "serialize.h"
+#include "pass_manager.h"
+#include "ir.h"
+#include "types.h"
+#include <grammar_views.h>
+#include <grammar_visitor.h>
 #include <filesystem>
 #include <functional>
+#include <unordered_map>
+#include <unordered_set>
 
 
 /////////////////////////////////////////////////////////////////
@@ -22,20 +31,20 @@ struct NamespacedIdentifier : public std::vector<std::string> {
 		
 		if (size()==1) {
 
-			if (ast->symbols.count(front())) return ast->symbols[front()];
+			if (ast->symbols().count(front())) return ast->symbols()[front()];
 			if (!ast->parent) from.log(ERROR) << "Symbol " << front() << " not found. Needed from: ";
 			return resolve(ast->parent, from);
 		}
 
 		SyntaxTree::SP a = ast;
 		for (auto &s : *this) {
-			if (a->symbols.count(s) == 0) 
+			if (a->symbols().count(s) == 0) 
 				break;
 
 			if ( &s == &back() ) 
-				return a->symbols[s];
+				return a->symbols()[s];
 			
-			a = a->symbols[s];
+			a = a->symbols()[s];
 		}
 
 		if (!ast->parent) from.log(ERROR) << "Symbol " << front() << " not found. Needed from: ";
@@ -54,148 +63,534 @@ static void register_symbol(SyntaxTree::SP &ast, const SyntaxTree::SP &type, con
 	
 	} while (translation_unit.id() != "translation_unit");
 
-	if (translation_unit->symbols.count(name)) 
+	if (translation_unit->symbols().count(name)) 
 		Log(ERROR) << "Symbol " << name << " already defined in scope. \n" 
-			<< "First definition in: " << translation_unit->symbols[name]->first->show_source() 
+			<< "First definition in: " << translation_unit->symbols()[name]->first->show_source() 
 			<< "Duplicated definition in: " << ast->first->show_source();
 
-	ast->type = type;
-	ast->generated_id += name;
-	translation_unit->symbols[name] = ast;
+	ast->type() = type;
+	ast->generated_id() += name;
+	translation_unit->symbols()[name] = ast;
 }
 
+/////////////////////////////////////////////////////////////////
+// MACRO TEMPLATES
+// MegaC code that is parsed once into a prototype, and copied on each expansion. Its holes are identifiers with the given names:
+// in each copy, the largest node that spans only one of them (with the ';' after it, for statements) is replaced by what that hole is filled with.
+struct MacroTemplate {
+
+	struct Hole { std::string name; std::vector<size_t> path; }; // indices of the children from the root to the node
+
+	SyntaxTree::SP prototype;
+	std::vector<Hole> holes;
+
+	MacroTemplate(const std::string &name, const std::string_view &source, const std::set<std::string> &hole_names) {
+
+		prototype = std::make_shared<SyntaxTree>( SourceFile::Manager::get(name, source) );
+
+		std::vector<std::pair<SyntaxTree *, std::vector<size_t>>> pending(1, { prototype.get(), {} });
+		while (not pending.empty()) {
+			auto [node, path] = std::move(pending.back());
+			pending.pop_back();
+
+			size_t length = node->last - node->first;
+			bool is_hole = node->first->type == Token::IDENTIFIER and hole_names.count(node->first->literal) and 
+				(length == 1 or (length == 2 and node->first[1].literal == ";"));
+			if (is_hole) {
+				holes.push_back({ node->first->literal, path });
+				continue;
+			}
+
+			for (size_t i = 0; i < node->children.size(); i++) {
+				if (not node->children[i]) continue;
+				path.push_back(i);
+				pending.emplace_back(node->children[i].get(), path);
+				path.pop_back();
+			}
+		}
+
+		for (auto &hole_name : hole_names) 
+			if (std::none_of(holes.begin(), holes.end(), [&](const Hole &h) { return h.name == hole_name; }))
+				Log(ERROR) << "Hole " << hole_name << " not found in " << name;
+	}
+
+	SyntaxTree::SP instantiate(const std::map<std::string, SyntaxTree::SP> &fills) const {
+
+		SyntaxTree::SP ret = SyntaxTree::clone(prototype);
+		for (auto &hole : holes) {
+
+			auto fill = fills.find(hole.name);
+			if (fill == fills.end()) 
+				Log(ERROR) << "Hole " << hole.name << " was not filled";
+
+			SyntaxTree::SP *slot = &ret;
+			for (auto i : hole.path) 
+				slot = &(*slot)->children[i];
+			*slot = fill->second;
+		}
+		return ret;
+	}
+};
+
 namespace CompilerPass {
 
 	/////////////////////////////////////////////////////////////////
 	// PREPROCESSOR PASS: 
 	//  * TARGETS: INCLUDE MODULES, SIMPLIFY SYNTAX
-	struct Preprocessor {
+	struct Preprocessor : AST::Visitor<Preprocessor> {
+
+		// Each include gets a copy of the tree of the file (see IncludedFiles), as the passes rewrite it.
+		// A file with a %once directive at its top level is included only the first time, the next includes of it are empty.
+		struct ParsedFile { bool once = false, included = false; };
+
+		// What is kept across the files of a compile, and for the function bodies that are expanded later (see SyntaxTree::SP::expand).
+		struct State {
+			std::map<std::string, ParsedFile> parsed_files;
+			std::set<std::string> imported_modules;
+			std::map<std::string, SyntaxTree::SP> templates;
+			std::map<std::pair<const SyntaxTree *, std::vector<std::string>>, SyntaxTree::SP> instances;
+		};
 
-		std::map<std::string, std::function<void(SyntaxTree::SP &)>> processors = {
+		State &state;
+		std::vector<const SyntaxTree *> instantiating; // instances whose own template instances are being instantiated, see instantiate
 
-			{"include", [&](SyntaxTree::SP &ast) { 
+		Preprocessor(State &state_) : state(state_) {}
 
-				if (ast[0].id() != "STRING_LITERAL")
-					ast.log(ERROR) << " include isn't a STRING_LITERAL";
+		static bool is_once_directive(SyntaxTree::SP ast) { return ast and ast.kind() == Kind::once_directive and AST::OnceDirective(ast).IDENTIFIER().literal() == "once"; }
 
-				std::filesystem::path ast_file_path = ast->first->begin_ptr.get_file().path;
-				std::string included_file_name = std::string(ast_file_path.parent_path()) + "/" + ast->children.front()->first->literal;
+		// The %once directive at the top level of a parsed file, if it has one.
+		static FlatSyntaxTree::Node once_directive(FlatSyntaxTree::Node file) {
+			for (size_t i = 0; i < file.size(); i++) 
+				if (file[i] and file[i].kind() == Kind::once_directive and file[i][0].literal() == "once") return file[i];
+			return {};
+		}
+
+		static void remove_once_directives(SyntaxTree::SP &ast) {
+			auto &children = ast->children;
+			children.erase(std::remove_if(children.begin(), children.end(), is_once_directive), children.end());
+		}
+
+		void on_include(SyntaxTree::SP &ast) { 
 
-				Log(INFO) << "Including file: " << included_file_name;
+			AST::Include include(ast);
+			if (include.STRING_LITERAL().kind() != Kind::STRING_LITERAL)
+				ast.log(ERROR) << " include isn't a STRING_LITERAL";
 
-				SourceFile &included_source_file = SourceFile::Manager::get(included_file_name);
+			std::string included_file_name = IncludedFiles::path(ast->first->begin_ptr.get_file(), include.STRING_LITERAL().literal());
 
-				SyntaxTree::SP included_syntax_tree = std::make_shared<SyntaxTree>( included_source_file );
+			Log(INFO) << "Including file: " << included_file_name;
 
-				included_syntax_tree->parent = ast->parent;
-				included_syntax_tree->old = ast;
-				included_syntax_tree->component = Grammar::Symbol::Component::Symbol("included_scope");
-							
-				ast = included_syntax_tree;
+			auto parsed_syntax_tree = IncludedFiles::get(included_file_name);
+			SyntaxTree::SP included_syntax_tree = parsed_syntax_tree->root().to_tree();
 
-			}},
+			auto &parsed_file = state.parsed_files[included_file_name];
+			parsed_file.once = bool(once_directive(parsed_syntax_tree->root()));
+			remove_once_directives(included_syntax_tree);
+			if (parsed_file.once and parsed_file.included) 
+				included_syntax_tree->children.clear();
+			parsed_file.included = true;
+
+			included_syntax_tree->parent = ast->parent;
+			included_syntax_tree->old() = ast;
+			included_syntax_tree->component = Grammar::Symbol::Component::Symbol("included_scope");
+						
+			ast = included_syntax_tree;
+
+		}
 
-			{"translation_unit_single", [&](SyntaxTree::SP &ast) { ast->component = Grammar::Symbol::Component::Symbol("translation_unit"); }},
+		// Each module is imported once per compile: from its interface (see GeneratorOptions::emit_interface()) if it is not older 
+		// than its source and none of the files in it changed, from its source otherwise. Both are looked for next to the importing file, 
+		// as <name>.mci and <name>.mc. Either way only the declarations of the module are imported, see keep_declarations.
+		void on_kw_import(SyntaxTree::SP &ast) {
+
+			std::string name = AST::Import(ast).IDENTIFIER().literal();
+			std::filesystem::path directory = std::filesystem::path(ast->first->begin_ptr.get_file().path).parent_path();
+			std::string source_path = std::filesystem::weakly_canonical(directory / (name + ".mc"));
+			std::string interface_path = std::filesystem::weakly_canonical(directory / (name + ".mci"));
+
+			bool has_source = std::filesystem::exists(source_path), has_interface = std::filesystem::exists(interface_path);
+			if (not has_source and not has_interface) 
+				ast.log(ERROR) << "Module " << name << " not found: neither " << source_path << " nor " << interface_path << " exist";
+
+			SyntaxTree::SP module_syntax_tree;
+			if (not state.imported_modules.insert(source_path).second) {
+
+				module_syntax_tree = std::make_shared<SyntaxTree>(*ast);
+				module_syntax_tree->children.clear();
+
+			} else {
+
+				if (has_interface and (not has_source or std::filesystem::last_write_time(interface_path) >= std::filesystem::last_write_time(source_path))) {
+					Log(INFO) << "Importing module " << name << " from " << interface_path;
+					module_syntax_tree = load_syntax_tree(interface_path);
+					if (module_syntax_tree) 
+						include_interface_files(module_syntax_tree);
+				}
+
+				if (not module_syntax_tree) {
+					if (not has_source) 
+						ast.log(ERROR) << "Could not load the interface of module " << name << " from " << interface_path;
+					Log(INFO) << "Importing module " << name << " from " << source_path;
+					module_syntax_tree = IncludedFiles::get(source_path)->root().to_tree();
+					remove_once_directives(module_syntax_tree);
+				}
+			}
+
+			module_syntax_tree->parent = ast->parent;
+			module_syntax_tree->old() = ast;
+			module_syntax_tree->component = Grammar::Symbol::Component::Symbol("included_scope");
+
+			ast = module_syntax_tree;
+		}
+
+		static bool is_import(const SyntaxTree::SP &ast) { 
+			return ast.kind() == Kind::included_scope and ast->annotations and ast->old() and ast->old().kind() == Kind::kw_import; 
+		}
+
+		// The files included in an interface count as included here, and those with a %once directive (kept by keep_declarations) 
+		// are left empty if they were already.
+		void include_interface_files(SyntaxTree::SP &ast) {
+
+			SyntaxTree::traverse(ast, [this](SyntaxTree::SP &node) {
+				if (node.kind() != Kind::included_scope or node->first == node->last or is_import(node)) return;
+
+				auto &parsed_file = state.parsed_files[node->first->begin_ptr.get_file().path];
+				parsed_file.once = std::any_of(node->children.begin(), node->children.end(), is_once_directive);
+				remove_once_directives(node);
+				if (parsed_file.once and parsed_file.included) 
+					node->children.clear();
+				parsed_file.included = true;
+			});
+		}
+
+		// Reduces a preprocessed scope to what the modules that import it get: functions without their bodies (see function_prototype),
+		// variables without their initializers, typedefs, and the namespaces and included files these are in. 
+		// For an interface that is saved, the modules it imported are turned back into imports, so that each one is still imported once
+		// per compile by whoever loads it, the included files keep their %once directive, and the scopes only span their first token,
+		// so that only the tokens of the declarations are saved with it.
+		void keep_declarations(SyntaxTree::SP &ast, bool saved) {
+
+			auto shrink = [saved](SyntaxTree::SP &node) { if (saved and node->first != node->last) node->last = node->first + 1; };
+
+			std::vector<SyntaxTree::SP> scopes(1, ast);
+			shrink(ast);
+			while (not scopes.empty()) {
+				SyntaxTree::SP scope = scopes.back();
+				scopes.pop_back();
+
+				std::vector<SyntaxTree::SP> declarations;
+				for (auto &c : scope->children) {
+
+					if (not c) continue;
+					Kind kind = c.kind();
+
+					if (is_import(c)) {
+						declarations.push_back(saved ? c->old() : c);
+						continue;
+					}
 
-			{"function_definition", [&](SyntaxTree::SP &ast) { 
+					if (kind == Kind::function_definition_with_implicit_type) 
+						declarations.push_back(prototype(AST::FunctionDefinitionWithImplicitType(c).function_definition()));
 
-				// We leverage function definintions as in C format for convenience, but this does not match very well our definition of function type, 
-				// so we modify the order of the function childrens to match the function type definintion
-				std::swap( ast->children[1], ast->children[2] );
-			}},
+					if (kind == Kind::type_declaration) {
+						for (auto &item : AST::InitDeclaratorList(AST::TypeDeclaration(c).init_declarator_list()).items()) 
+							if (item.kind() == Kind::op_eq) item = item[0];
+						declarations.push_back(c);
+					}
 
-			{"foreach", [&](SyntaxTree::SP &ast) { 
+					if (kind == Kind::kw_typedef or kind == Kind::function_prototype or kind == Kind::once_directive) 
+						declarations.push_back(c);
+
+					// Whoever loads an interface instantiates the templates it uses again.
+					if (kind == Kind::instance_declaration and not saved) 
+						declarations.push_back(c);
+
+					if (kind == Kind::included_scope) {
+						auto parsed_file = state.parsed_files.find(c->first != c->last ? c->first->begin_ptr.get_file().path : "");
+						if (saved and parsed_file != state.parsed_files.end() and parsed_file->second.once) 
+							if (auto directive = once_directive(IncludedFiles::get(parsed_file->first)->root())) 
+								c->children.insert(c->children.begin(), directive.to_tree());
+						declarations.push_back(c);
+						scopes.push_back(c);
+						shrink(c);
+					}
 
-				// It's not that I took the terminator from stackoverflow, but I just really like Vogons.
-				static const constexpr std::string_view foreach_string = R"V0G0N(
-				{
-					auto __mc__begin = a1.begin;
-					auto __mc__end = a2.end;
-					for ( ; __mc__begin != __mc__end ; ++__mc__begin )  {
-						auto a3 = __mc__begin[0];
-						{
-							a4;
+					if (kind == Kind::kw_namespace) {
+						declarations.push_back(c);
+						AST::Namespace namespace_ast(c);
+						if (namespace_ast.has_translation_unit()) {
+							scopes.push_back(namespace_ast.translation_unit());
+							shrink(namespace_ast.translation_unit());
 						}
+						shrink(c);
 					}
 				}
-				)V0G0N";	
+				scope->children = declarations;
+			}
+		}
 
-				SourceFile &foreach_file = SourceFile::Manager::get("__mc__foreach_macro", foreach_string);
-				SyntaxTree::SP foreach_ast = std::make_shared<SyntaxTree>( foreach_file );
+		// The prototype of a function_definition: the same node without its body, and spanning up to it.
+		static SyntaxTree::SP prototype(SyntaxTree::SP &definition) {
 
-				//std::cerr << foreach_ast->to_string(); 
-				SyntaxTree::SP &a1 = foreach_ast[0][0][0][1][0];
-				//std::cerr << "A1: \n" << a1->to_string(); 
-				SyntaxTree::SP &a2 = foreach_ast[0][1][0][1][0];
-				//std::cerr << "A2: \n" << a2->to_string(); 
-				SyntaxTree::SP &a3 = foreach_ast[0][2][2][0][0][0][0];
-				//std::cerr << "A3: \n" << a3->to_string(); 
-				SyntaxTree::SP &a4 = foreach_ast[0][2][2][0][1];
-				//std::cerr << "A4: \n" << a4->to_string(); 
+			AST::FunctionDefinition definition_ast(definition);
+			auto ret = std::make_shared<SyntaxTree>(definition->first, Grammar::Symbol::Component::Symbol("function_prototype"), definition->parent->parent);
+			ret->last = definition_ast.function_body()->first;
+			ret->children = { definition_ast.function_return_type(), definition_ast.function_name(), definition_ast.function_parameter_list_scoped() };
+			if (definition_ast.has_attribute_section()) 
+				ret->children.push_back(definition_ast.attribute_section());
+			return ret;
+		}
 
-				//std::cerr << ast->to_string(); 
+		// Generic structs are instantiated once per distinct list of argument types: the instance is declared once, at the end of the 
+		// scope of the template (see instance_declaration), and each use of it is annotated with the struct it stands for.
+		// Templates are named by typedef, qualified by the namespaces around it, and looked up from the innermost namespace out.
+		static std::vector<std::string> namespaces_around(const SyntaxTree::SP &ast) {
+			std::vector<std::string> ret;
+			for (SyntaxTree::SP p = ast->parent; p; p = p->parent) 
+				if (p.kind() == Kind::kw_namespace) ret.insert(ret.begin(), AST::Namespace(p).IDENTIFIER().literal());
+			return ret;
+		}
 
-				a1 = ast[1];
-				a2 = ast[1];
-				a3 = ast[0];
-				a4 = ast[2];
+		// The typedef a type name refers to, looked up from the scope it is used in out. Included files are part of the scope that includes them.
+		static SyntaxTree::SP find_typedef(const SyntaxTree::SP &ast, const std::vector<std::string> &name) {
+			for (SyntaxTree::SP p = ast->parent; p; p = p->parent) 
+				if (p.kind() == Kind::translation_unit or p.kind() == Kind::included_scope) 
+					if (auto found = find_typedef_in(p, name, 0)) return found;
+			return {};
+		}
+
+		static SyntaxTree::SP find_typedef_in(const SyntaxTree::SP &scope, const std::vector<std::string> &name, size_t i) {
+			for (auto &c : scope->children) {
+
+				if (not c) continue;
+				Kind kind = c.kind();
+
+				if (kind == Kind::included_scope) 
+					if (auto found = find_typedef_in(c, name, i)) return found;
 
-				foreach_ast->parent = ast->parent;
-				foreach_ast->old = ast;
-				ast = foreach_ast;
+				if (kind == Kind::kw_typedef and i + 1 == name.size() and AST::Typedef(c).IDENTIFIER().literal() == name[i]) 
+					return c;
+
+				if (kind == Kind::kw_namespace and i + 1 < name.size() and AST::Namespace(c).IDENTIFIER().literal() == name[i] and AST::Namespace(c).has_translation_unit()) 
+					if (auto found = find_typedef_in(AST::Namespace(c).translation_unit(), name, i + 1)) return found;
+			}
+			return {};
+		}
 
-				//std::cerr << ast->to_string(); 
+		void on_kw_typedef(SyntaxTree::SP &ast) {
 
-			}},
+			AST::Typedef typedef_ast(ast);
+			auto &type_name = typedef_ast.type_name();
+			if (type_name->children.empty() or type_name[0].kind() != Kind::generic_struct) return;
 
+			std::string name;
+			for (auto &n : namespaces_around(ast)) 
+				name += n + "::";
+			name += typedef_ast.IDENTIFIER().literal();
+
+			if (state.templates.count(name)) 
+				ast.log(ERROR) << "Template " << name << " already defined in: " << state.templates[name]->first->show_source() << "Defined again in: ";
+			state.templates[name] = type_name[0];
+		}
+
+		void on_template_instance(SyntaxTree::SP &ast) { 
 			
-			{"auto", [&](SyntaxTree::SP &ast) { 
+			// Uses of the parameters are only known once the generic struct is instantiated.
+			for (SyntaxTree::SP p = ast->parent; p; p = p->parent) 
+				if (p.kind() == Kind::generic_struct) return;
 
-				// It's not that I took the terminator from stackoverflow, but I just really like Vogons.
-				static const constexpr std::string_view auto_string = R"V0G0N(
-					typeof(a1) a2 = a3;
-				)V0G0N";	
+			instantiate(ast); 
+		}
 
-				SourceFile &auto_file = SourceFile::Manager::get("__mc__auto_macro", auto_string);
-				SyntaxTree::SP auto_ast = std::make_shared<SyntaxTree>( auto_file );
-				auto_ast = auto_ast[0];
+		void instantiate_all(SyntaxTree::SP &ast) {
+			SyntaxTree::traverse(ast, [this](SyntaxTree::SP &node) { if (node.kind() == Kind::template_instance) instantiate(node); });
+		}
 
-				//std::cerr << auto_ast->to_string(); 
-				SyntaxTree::SP &a1 = auto_ast[0][0][0];
-				//std::cerr << "A1: \n" << a1->to_string(); 
-				SyntaxTree::SP &a2 = auto_ast[1][0][0];
-				//std::cerr << "A2: \n" << a2->to_string(); 
-				SyntaxTree::SP &a3 = auto_ast[1][0][1];
-				//std::cerr << "A3: \n" << a3->to_string(); 
+		// The type a template argument stands for, with the typedefs it names followed, so that it means the same in the scope of the template.
+		// Arguments are told apart by their interned type, or by the node they resolve to when the TypeTable can not resolve them (typeof, or names in them).
+		// Substituting a copy of the resolved node keeps its type, as copies keep the annotations the TypeTable left on it.
+		SyntaxTree::SP resolve_argument(SyntaxTree::SP &argument, std::string &key) {
 
-				//std::cerr << ast->to_string(); 
+			instantiate_all(argument);
 
-				a1 = ast[0][1];
-				a2 = ast[0][0];
-				a3 = ast[0][1];
+			SyntaxTree::SP resolved = argument;
+			std::set<const SyntaxTree *> followed;
+			while (not TypeTable::global().of(resolved) and resolved->children.size() == 1 and resolved[0].kind() == Kind::namespaced_identifier) {
 
-				auto_ast->parent = ast->parent;
-				auto_ast->old = ast;
-				ast = auto_ast;
+				auto declaration = find_typedef(resolved, NamespacedIdentifier(resolved[0]));
+				if (not declaration) 
+					argument.log(ERROR) << "Unknown type";
+				if (not followed.insert(declaration.get()).second) 
+					declaration.log(ERROR) << "Typedef refers to itself";
 
-				//std::cerr << ast->to_string(); 
-				//Log(ERROR) << "";
+				resolved = AST::Typedef(declaration).type_name();
+				instantiate_all(resolved);
+			}
 
-			}},
-		};
+			const Type *type = TypeTable::global().of(resolved);
+			key = std::to_string(type ? reinterpret_cast<uintptr_t>(type) : reinterpret_cast<uintptr_t>(resolved.get()));
+			return resolved;
+		}
 
-		void process(SyntaxTree::SP &ast) {
+		void instantiate(SyntaxTree::SP &ast) {
 
-			std::string symbol = ast.id();
+			if (ast->annotations and ast->type()) return;
 
-			if (processors.count(symbol))
-				processors[symbol](ast);
+			AST::TemplateInstance instance(ast);
+			SyntaxTree::link_parents(ast.get());
 
-			for (auto &c : ast->children)
-				c->parent = ast;
+			std::string name;
+			for (auto &c : instance.namespaced_identifier()->children) 
+				name += (name.empty() ? "" : "::") + c.literal();
 
-			for (auto &c : ast->children)
-				process(c);
+			SyntaxTree::SP generic;
+			auto namespaces = namespaces_around(ast);
+			for (size_t n = namespaces.size() + 1; n-- and not generic; ) {
+				std::string qualified;
+				for (size_t i = 0; i < n; i++) 
+					qualified += namespaces[i] + "::";
+				qualified += name;
+				if (state.templates.count(qualified)) generic = state.templates[qualified];
+			}
+			if (not generic) 
+				ast.log(ERROR) << "Unknown template " << name;
+
+			auto &arguments = AST::TemplateArgumentList(instance.template_argument_list()).items();
+			std::vector<std::string> key(arguments.size());
+			std::vector<SyntaxTree::SP> resolved;
+			for (size_t i = 0; i < arguments.size(); i++) 
+				resolved.push_back(resolve_argument(arguments[i], key[i]));
+
+			AST::GenericStruct generic_struct(generic);
+			auto &parameters = AST::TemplateParameterList(generic_struct.template_parameter_list()).items();
+			if (parameters.size() != arguments.size()) 
+				ast.log(ERROR) << "Template " << name << " takes " << parameters.size() << " arguments, not " << arguments.size();
+
+			auto &instance_ast = state.instances[{ generic.get(), key }];
+			if (instance_ast) {
+				if (std::find(instantiating.begin(), instantiating.end(), instance_ast.get()) != instantiating.end()) 
+					ast.log(ERROR) << "Template " << name << " contains itself";
+				ast->type() = instance_ast;
+				return;
+			}
+
+			std::map<std::string, SyntaxTree::SP> fills;
+			for (size_t i = 0; i < parameters.size(); i++) 
+				fills[AST::TemplateParameter(parameters[i]).IDENTIFIER().literal()] = resolved[i];
+
+			instance_ast = SyntaxTree::clone(generic);
+			instance_ast->children.erase(instance_ast->children.begin());
+			instance_ast->component = Grammar::Symbol::Component::Symbol("struct");
+			SyntaxTree::traverse(instance_ast, [&](SyntaxTree::SP &node) {
+				if (node.kind() != Kind::template_parameter) return;
+				std::string parameter = AST::TemplateParameter(node).IDENTIFIER().literal();
+				if (not fills.count(parameter)) 
+					node.log(ERROR) << "Unknown template parameter #" << parameter;
+				node = SyntaxTree::clone(fills[parameter]);
+			});
+
+			SyntaxTree::SP scope = generic->parent->parent->parent;
+			auto declaration = std::make_shared<SyntaxTree>(generic->first, Grammar::Symbol::Component::Symbol("instance_declaration"), scope);
+			declaration->last = generic->last;
+			declaration->children.push_back(instance_ast);
+			SyntaxTree::link_parents(declaration.get());
+			scope->children.push_back(declaration);
+			ast->type() = instance_ast;
+
+			// Its scope may have been processed already, so the instances it uses are instantiated right away.
+			SyntaxTree::SP struct_ast = instance_ast;
+			instantiating.push_back(struct_ast.get());
+			instantiate_all(struct_ast);
+			instantiating.pop_back();
+		}
+
+		// Annotations are not saved with a tree (see serialize.h), so the instances of a loaded tree are declared again, for its uses to refer to.
+		void instantiate_loaded(SyntaxTree::SP &ast) {
+
+			SyntaxTree::traverse(ast, [this](SyntaxTree::SP &node) {
+				auto &children = node->children;
+				children.erase(std::remove_if(children.begin(), children.end(), 
+					[](const SyntaxTree::SP &c) { return c and c.kind() == Kind::instance_declaration; }), children.end());
+				for (auto &c : children) 
+					if (c) c->parent = node;
+
+				if (node.kind() == Kind::kw_typedef) on_kw_typedef(node);
+				if (node.kind() == Kind::template_instance) on_template_instance(node);
+			});
+		}
+
+		// Directives of the file being compiled, the ones of included files are handled by on_include.
+		void on_translation_unit(SyntaxTree::SP &ast) { if (not ast->parent) remove_once_directives(ast); }
+
+		void on_once_directive(SyntaxTree::SP &ast) { 
+
+			if (not is_once_directive(ast))
+				ast.log(ERROR) << "Unknown directive %" << AST::OnceDirective(ast).IDENTIFIER().literal();
+			ast.log(ERROR) << "%once must be at the top level of a file";
+		}
+
+		void on_translation_unit_single(SyntaxTree::SP &ast) { ast->component = Grammar::Symbol::Component::Symbol("translation_unit"); }
+
+		void on_foreach(SyntaxTree::SP &ast) { 
+
+			// It's not that I took the terminator from stackoverflow, but I just really like Vogons.
+			static const constexpr std::string_view foreach_string = R"V0G0N(
+			{
+				auto __mc__begin = a1.begin;
+				auto __mc__end = a2.end;
+				for ( ; __mc__begin != __mc__end ; ++__mc__begin )  {
+					auto a3 = __mc__begin[0];
+					a4;
+				}
+			}
+			)V0G0N";	
+
+			static const MacroTemplate foreach_template("__mc__foreach_macro", foreach_string, { "a1", "a2", "a3", "a4" });
+
+			AST::Foreach foreach(ast);
+			SyntaxTree::SP foreach_ast = foreach_template.instantiate({
+				{ "a1", foreach.expression() },
+				{ "a2", foreach.expression() },
+				{ "a3", foreach.IDENTIFIER() },
+				{ "a4", foreach.translation_unit_single() },
+			});
+
+			foreach_ast->parent = ast->parent;
+			foreach_ast->old() = ast;
+			ast = foreach_ast;
+		}
+
+		
+		void on_kw_auto(SyntaxTree::SP &ast) { 
+
+			// It's not that I took the terminator from stackoverflow, but I just really like Vogons.
+			static const constexpr std::string_view auto_string = R"V0G0N(
+				typeof(a1) a2 = a3;
+			)V0G0N";	
+
+			static const MacroTemplate auto_template("__mc__auto_macro", auto_string, { "a1", "a2", "a3" });
+
+			auto &init_declaration = AST::Auto(ast).init_declaration();
+			SyntaxTree::SP auto_ast = auto_template.instantiate({
+				{ "a1", init_declaration[1] },
+				{ "a2", init_declaration[0] },
+				{ "a3", init_declaration[1] },
+			})[0];
+
+			auto_ast->parent = ast->parent;
+			auto_ast->old() = ast;
+			ast = auto_ast;
+		}
+
+		void process(SyntaxTree::SP &ast) {
+
+			SyntaxTree::traverse(ast, 
+				[this](SyntaxTree::SP &node) {
+					dispatch(node);
+					for (auto &c : node->children)
+						c->parent = node;
+				}, 
+				[this](SyntaxTree::SP &node) { if (is_import(node)) keep_declarations(node, false); });
 		}
 
 	};
@@ -203,137 +598,197 @@ namespace CompilerPass {
 
 	/////////////////////////////////////////////////////////////////
 	// COMPILER PASS: INDENTIFY SYMBOLS AND ATTRIBUTES
-	struct Symbols{
+	struct Symbols : AST::Visitor<Symbols> {
 
-		std::map<std::string, std::function<void(SyntaxTree::SP &)>> processors = {
+		void on_function_definition(SyntaxTree::SP &ast) { 
+			
+			std::string function_name = AST::FunctionName(AST::FunctionDefinition(ast).function_name()).IDENTIFIER().literal();
 
+			SyntaxTree::SP type = ast->parent;
 
-			{"function_definition", [&](SyntaxTree::SP &ast) { 
-				
-				std::string function_name =  ast[2][0].literal();
+			register_symbol( ast, type, function_name );
+		}
 
-				SyntaxTree::SP type = ast->parent;
+		void on_function_prototype(SyntaxTree::SP &ast) { 
+			
+			std::string function_name = AST::FunctionName(AST::FunctionPrototype(ast).function_name()).IDENTIFIER().literal();
 
-				register_symbol( ast, type, function_name );
-			}},
+			register_symbol( ast, ast, function_name );
+		}
 
-			{"type_declaration", [&](SyntaxTree::SP &ast)  { 
-				
-				auto &type_declaration_list = ast[1];
-				for (std::size_t i = 0; i < type_declaration_list->children.size(); i++ ) {
+		void on_type_declaration(SyntaxTree::SP &ast) { 
+			
+			AST::TypeDeclaration type_declaration(ast);
+			for (auto c : AST::InitDeclaratorList(type_declaration.init_declarator_list()).items()) {
 
-					auto c = type_declaration_list[i];
-					if ( c.id() == "=" )
-						c = c[0];
+				if ( c.kind() == Kind::op_eq )
+					c = c[0];
 
-					std::string symbol_name =  c->first->literal;
+				std::string symbol_name =  c->first->literal;
 
-					auto &type = ast[0];
+				auto &type = type_declaration.type_name();
 
-					register_symbol( ast, type, symbol_name );
-				}
-			}},
+				register_symbol( ast, type, symbol_name );
+			}
+		}
 
-			{"namespace", [&](SyntaxTree::SP &ast)  { 
-							
-				std::string namespace_name = ast->children[0]->first->literal;
+		void on_kw_namespace(SyntaxTree::SP &ast) { 
+						
+			AST::Namespace namespace_ast(ast);
+			std::string namespace_name = namespace_ast.IDENTIFIER()->first->literal;
 
-				register_symbol( ast->children[1], ast, namespace_name );
-			}},
+			register_symbol( namespace_ast.translation_unit(), ast, namespace_name );
+		}
 
-			{"attributes", [&](SyntaxTree::SP &ast)  { 
+		void on_attributes(SyntaxTree::SP &ast) { 
 
-				std::map<std::string, SyntaxTree::SP> &attributes = ast->parent->attributes;
-			
-				for ( auto &attribute : ast->children ) {
+			std::map<std::string, SyntaxTree::SP> &attributes = ast->parent->attributes();
+		
+			for ( auto &attribute : ast->children ) {
 
-					if (attribute.id() == "=" ) {
+				if (attribute.kind() == Kind::op_eq) {
 
-						std::string name = attribute->children[0]->first->literal;
-						if (attributes.count(name)) 
-							attribute->children[0].log(ERROR) << "Attribute " << name << " already defined in: ";
+					std::string name = attribute->children[0]->first->literal;
+					if (attributes.count(name)) 
+						attribute->children[0].log(ERROR) << "Attribute " << name << " already defined in: ";
 
-						attributes.emplace( name, attribute->children[1] );
-					} else {
+					attributes.emplace( name, attribute->children[1] );
+				} else {
 
-						std::string name = attribute->first->literal;
-						attributes.emplace( name, attribute );
-					}
+					std::string name = attribute->first->literal;
+					attributes.emplace( name, attribute );
 				}
-			}},
-		};
+			}
+		}
 
 		void process(SyntaxTree::SP &ast) {
 
-			std::string symbol = ast.id();
+			SyntaxTree::traverse(ast, [this](SyntaxTree::SP &node) {
+				dispatch(node);
+				for (auto &c : node->children)
+					c->parent = node;
+			});
+		}
 
-			if (processors.count(symbol))
-				processors[symbol](ast);
+	};
 
-			for (auto &c : ast->children)
-				c->parent = ast;
 
-			for (auto &c : ast->children)
-				process(c);
+	/////////////////////////////////////////////////////////////////
+	// COMPILER PASS: INDENTIFY TYPES
+	struct Types : AST::Visitor<Types> {
+
+		void on_kw_void(SyntaxTree::SP &ast) { ast->c_type() = TypeTable::global().of(ast)->c_name(); }
+		void on_kw_int8(SyntaxTree::SP &ast) { ast->c_type() = TypeTable::global().of(ast)->c_name(); }
+		void on_kw_uint8(SyntaxTree::SP &ast) { ast->c_type() = TypeTable::global().of(ast)->c_name(); }
+		void on_kw_int16(SyntaxTree::SP &ast) { ast->c_type() = TypeTable::global().of(ast)->c_name(); }
+		void on_kw_uint16(SyntaxTree::SP &ast) { ast->c_type() = TypeTable::global().of(ast)->c_name(); }
+		void on_type_name(SyntaxTree::SP &ast) { 
+			if (ast->children.size() != 1)
+				ast.log(ERROR) << "Type name does not have a single child";
+			// Resolves the types below it too, even though they are visited later.
+			if (auto type = TypeTable::global().of(ast))
+				ast->c_type() = type->c_name(); 
+		}
+
+		void process(SyntaxTree::SP &ast) {
+
+			SyntaxTree::traverse(ast, [this](SyntaxTree::SP &node) {
+				for (auto &c : node->children)
+					c->parent = node;
+				dispatch(node);
+			});
 		}
 
 	};
 
 
 	/////////////////////////////////////////////////////////////////
-	// COMPILER PASS: INDENTIFY TYPES
-	struct Types{
-
-		std::map<std::string, std::function<void(SyntaxTree::SP &)>> processors = {
-
-			{"void",   [&](SyntaxTree::SP &ast) { ast->c_type = "void"; }},
-			{"int8",   [&](SyntaxTree::SP &ast) { ast->c_type = "int8_t"; }},
-			{"uint8",  [&](SyntaxTree::SP &ast) { ast->c_type = "uint8_t"; }},
-			{"int16",  [&](SyntaxTree::SP &ast) { ast->c_type = "int16_t"; }},
-			{"uint16", [&](SyntaxTree::SP &ast) { ast->c_type = "uint16_t"; }},
-			{"int32",  [&](SyntaxTree::SP &ast) { ast->c_type = "int32_t"; }},
-			{"uint32", [&](SyntaxTree::SP &ast) { ast->c_type = "uint32_t"; }},
-			{"type_name", [&](SyntaxTree::SP &ast) { 
-				if (ast->children.size() != 1)
-					ast.log(ERROR) << "Type name does not have a single child";
-				ast->c_type = ast[0]->c_type; 
-			}},
-		};
+	// COMPILER PASS: HASH CONSING
+	// Structurally identical pure expressions of a scope become a single shared node, so later passes analyze each once.
+	// Nodes are keyed by kind, leaf token and the (already shared) children, so equality only compares pointers.
+	// Pure means an rvalue that reads no memory: constants and the operators on them. Names, member accesses, indexing and
+	// dereferences read memory, and a name means something else where it is declared. A shared node has several parents,
+	// and its parent is whichever the last walk set: nothing in it may look its parent up, which only names and declarations do.
+	// Type names are left alone: the Types pass reads the types of children that it has not visited yet.
+	struct HashConsing {
+
+		static bool is_pure(Kind kind) {
+
+			static const std::vector<bool> pure = [] {
+				std::vector<bool> ret(kind_count, false);
+				for (auto k : {
+					Kind::CONSTANT, Kind::expression, Kind::kw_sizeof,
+					Kind::op_star, Kind::op_slash, Kind::op_percent, Kind::op_plus, Kind::op_minus, Kind::op_lt_lt, Kind::op_gt_gt,
+					Kind::op_lt, Kind::op_gt, Kind::op_lt_eq, Kind::op_gt_eq, Kind::op_eq_eq, Kind::op_not_eq,
+					Kind::op_amp, Kind::op_caret, Kind::op_pipe, Kind::kw_and, Kind::kw_or, Kind::op_question, Kind::op_tilde, Kind::op_not })
+					ret[size_t(k)] = true;
+				return ret;
+			}();
+			return pure[size_t(kind)];
+		}
+
+		static bool same(const SyntaxTree::SP &a, const SyntaxTree::SP &b) {
+
+			if (a->component.kind() != b->component.kind() or a->children != b->children) return false;
+			if (not a->children.empty()) return true;
+			return a->first->type == b->first->type and a->first->literal == b->first->literal and a->first->val == b->first->val;
+		}
 
+		std::unordered_map<uint64_t, std::vector<SyntaxTree::SP>> nodes; // by scope and hash
+		size_t expressions = 0, shared = 0;
+
+		// Children come first, as a node is keyed by its shared children. Scopes are the translation units being walked.
 		void process(SyntaxTree::SP &ast) {
 
-			std::string symbol = ast.id();
+			std::vector<const SyntaxTree *> scopes(1, nullptr);
 
-			for (auto &c : ast->children)
-				c->parent = ast;
+			SyntaxTree::traverse(ast, 
+				[&scopes](SyntaxTree::SP &node) { 
+					if (node.kind() == Kind::translation_unit) scopes.push_back(node.get()); 
+				},
+				[this, &scopes](SyntaxTree::SP &node) {
+					if (node.kind() == Kind::translation_unit) scopes.pop_back();
+					share(node, scopes.back());
+				});
+		}
 
-			if (processors.count(symbol))
-				processors[symbol](ast);
+		void share(SyntaxTree::SP &ast, const SyntaxTree *scope) {
 
+			// A '*' with one operand would be a dereference.
+			bool pure = (not ast->is_lazy) and is_pure(ast.kind()) and (ast.kind() != Kind::op_star or ast->children.size() == 2);
 			for (auto &c : ast->children)
-				process(c);
+				pure = pure and c and c->hash;
+
+			ast->hash = 0;
+			if (not pure) return;
+
+			uint64_t h = size_t(ast.kind()) * 0x9E3779B97F4A7C15ull;
+			if (ast->children.empty()) 
+				h ^= std::hash<std::string>()(ast->first->literal) + ast->first->val * 0xC2B2AE3D27D4EB4Full + ast->first->type;
+			for (auto &c : ast->children) 
+				h = (h ^ c->hash) * 0x100000001B3ull;
+			ast->hash = uint32_t(h ^ (h >> 32)) | 1;
+
+			expressions++;
+			auto &bucket = nodes[(uint64_t(ast->hash) << 32) ^ std::hash<const SyntaxTree *>()(scope)];
+			for (auto &n : bucket) {
+				if (n == ast or not same(n, ast)) continue;
+				ast = n;
+				shared++;
+				return;
+			}
+			bucket.push_back(ast);
 		}
-
 	};
 
 
 	/////////////////////////////////////////////////////////////////
 	// OPTIMIZER PASS: 
-	struct Optimizer {
-
-		std::map<std::string, std::function<void(SyntaxTree::SP &)>> processors = {
-
-		};
+	struct Optimizer : AST::Visitor<Optimizer> {
 
 		void process(SyntaxTree::SP &ast) {
 
-			std::string symbol = ast.id();
-
-			if (processors.count(symbol))
-				processors[symbol](ast);
-
-			for (auto &c : ast->children)
-				process(c);
+			SyntaxTree::traverse(ast, [this](SyntaxTree::SP &node) { dispatch(node); });
 		}
 
 	};
@@ -342,7 +797,7 @@ namespace CompilerPass {
 	/////////////////////////////////////////////////////////////////
 	// CODE GENERATION PASS: 
 	// There is no optimizations here, only raw code generation. Not even inling.
-	struct CodeGeneration {
+	struct CodeGeneration : AST::Visitor<CodeGeneration> {
 
 		const char *endl = "\n";
 		struct OutputFile {
@@ -380,213 +835,310 @@ namespace CompilerPass {
 
 		std::string type_to_c(SyntaxTree::SP ast) {
 
-			if (ast.id() == "type_name") {
-				if ( ast->children.size() != 1 ) {
-					Log(ERROR) << "More than 1 children?";
-				}
-				return type_to_c( ast[0] );	
-			}
+			if (ast.id() == "type_name" and ast->children.size() != 1) 
+				Log(ERROR) << "More than 1 children?";
+
+			auto type = TypeTable::global().of(ast);
+			if (type and not type->c_name().empty()) 
+				return type->c_name();
+			return ast.id() == "type_name" ? ast[0].id() : ast.id();
+		}	
+		
+		void on_included_scope(SyntaxTree::SP &ast) { 
+			for (auto &c : ast->children)
+				process(c);
+		}
 
-			if (ast.id()=="void") return "void";
-			if (ast.id()=="uint8") return "uint8_t";
-			if (ast.id()=="uint16") return "uint16_t";
-			if (ast.id()=="int8") return "int8_t";
-			if (ast.id()=="int16") return "int16_t";
+		void on_kw_namespace(SyntaxTree::SP &ast) { 
 			
+			AST::Namespace namespace_ast(ast);
+			auto old_prefix = state.prefix;
+			state.prefix += namespace_ast.IDENTIFIER()->first->literal + "_";
+			std::cout << state.prefix << std::endl;
+			process(namespace_ast.translation_unit()); 
+			state.prefix = old_prefix;
+		}
 
-			std::string ret = ast.id();
+		void on_type_declaration(SyntaxTree::SP &) { }
 
+		void on_kw_typedef(SyntaxTree::SP &) { }
 
-			return ret;
+		void on_instance_declaration(SyntaxTree::SP &) { }
 
-		}	
-		
-		std::map<std::string, std::function<void(SyntaxTree::SP &)>> processors = {
+		void on_function_definition_with_implicit_type(SyntaxTree::SP &) { }
 
-			{"included_scope", [&](SyntaxTree::SP &ast) { process(ast[0]); }},
+		void on_function_prototype(SyntaxTree::SP &) { }
 
-			{"namespace", [&](SyntaxTree::SP &ast) { 
-				
-				auto old_prefix = state.prefix;
-				state.prefix += ast[0]->first->literal + "_";
-				std::cout << state.prefix << std::endl;
-				process(ast[1]); 
-				state.prefix = old_prefix;
-			}},
+/* FUNCTION CODE IS ONLY GENERATED LAZY, SO WE KNOW WHICH KIND OF POINTERS ARE NEEDED AND IF THEY NEED AN INDEPENDENT MODULE OR NOT.
+			auto old_code_unit = state.current_code_unit;
+			
+			auto function_name = ast[0][2].literal();
 
-			{"type_declaration", [&](SyntaxTree::SP &) { }},
+			state.current_code_unit = state.prefix + function_name;
 
-			{"function_definition_with_implicit_type", [&](SyntaxTree::SP &) { }},
+			auto &header = state.code_units["declarations.h"];
 
-	/* FUNCTION CODE IS ONLY GENERATED LAZY, SO WE KNOW WHICH KIND OF POINTERS ARE NEEDED AND IF THEY NEED AN INDEPENDENT MODULE OR NOT.
-				auto old_code_unit = state.current_code_unit;
-				
-				auto function_name = ast[0][2].literal();
+			auto function_type = ast[0][0][0];
 
-				state.current_code_unit = state.prefix + function_name;
+			Log(INFO) << function_name;
 
-				auto &header = state.code_units["declarations.h"];
+			header << "extern " << type_to_c(function_type) << " " << function_name << "(";
+			auto &args = ast[0][1]->children;
+			for (auto &arg : args) {
+				if ( &arg != &args.front() ) header << ", ";
+				header << type_to_c(arg[0]);
+			}
+			header << ")" << endl;
 
-				auto function_type = ast[0][0][0];
+			//process(ast[0][3]); 
 
-				Log(INFO) << function_name;
+			state.current_code_unit = old_code_unit;			
+		}},*/
 
-				header << "extern " << type_to_c(function_type) << " " << function_name << "(";
-				auto &args = ast[0][1]->children;
-				for (auto &arg : args) {
-					if ( &arg != &args.front() ) header << ", ";
-					header << type_to_c(arg[0]);
-				}
-				header << ")" << endl;
+		void on_expression(SyntaxTree::SP &asp) { 
 
-				//process(ast[0][3]); 
+			if (asp->children.size() != 1) Log(ERROR) << "Malformed expression.";
+			process( asp[0] );
+		}
 
-				state.current_code_unit = old_code_unit;			
-			}},*/
+		void on_STRING_LITERAL(SyntaxTree::SP &asp) { 
 
-			{"expression", [&](SyntaxTree::SP &asp) { 
+			auto &oss = state.code_units[state.current_code_unit];
+			{
+				bool good = asp.literal().size()<40;
+				for (uint c : asp.literal()) 
+					if (c<32 or c>127) 
+						good = false;
+				if (good)
+					oss << "\\\\ STRING LITERAL: \"" << asp.literal() << "\"\n";
+			}
 
-				if (asp->children.size() != 1) Log(ERROR) << "Malformed expression.";
-				process( asp[0] );
-			}},
+			oss << "const uint8_t " << asp->generated_id() << "[] = { ";
+			for (uint c : asp.literal()) 
+				oss << c << ", ";
+			oss << "};" << endl;
+		}
 
-			{"STRING_LITERAL", [&](SyntaxTree::SP &asp) { 
+		void on_translation_unit(SyntaxTree::SP &ast) { 
 
-				auto &oss = state.code_units[state.current_code_unit];
-				{
-					bool good = asp.literal().size()<40;
-					for (uint c : asp.literal()) 
-						if (c<32 or c>127) 
-							good = false;
-					if (good)
-						oss << "\\\\ STRING LITERAL: \"" << asp.literal() << "\"\n";
-				}
+			auto &oss = state.code_units[state.current_code_unit];
 
-				oss << "const uint8_t " << asp->generated_id << "[] = { ";
-				for (uint c : asp.literal()) 
-					oss << c << ", ";
-				oss << "};" << endl;
-			}},
+			oss.start_scope();
+			
+			for (auto &c : ast->children)
+				process( c );
+	
+			oss.end_scope();
+		}
 
-			{"translation_unit", [&](SyntaxTree::SP &ast) { 
+		void on_function_call(SyntaxTree::SP &ast) { 
 
-				auto &oss = state.code_units[state.current_code_unit];
+			auto &oss = state.code_units[state.current_code_unit];
 
-				oss.start_scope();
-				
-				for (auto &c : ast->children)
-					process( c );
-		
-				oss.end_scope();
-			}},
+			AST::FunctionCall function_call(ast);
+			NamespacedIdentifier function_name(function_call.postfix_expression());
+			auto funtion_declaration_ast = function_name.resolve(ast);
 
-			{"function_call", [&](SyntaxTree::SP &ast) { 
+//			std::cout << funtion_ast->type()->to_string();
 
-				auto &oss = state.code_units[state.current_code_unit];
+			auto &function_call_args = function_call.argument_expression_list()->children;
+			auto &function_declaration_args = (funtion_declaration_ast.kind() == Kind::function_prototype ? 
+				AST::FunctionPrototype(funtion_declaration_ast).function_parameter_list_scoped() : 
+				AST::FunctionDefinition(funtion_declaration_ast).function_parameter_list_scoped())->children;
 
-				NamespacedIdentifier function_name(ast->children[0]);
-				auto funtion_declaration_ast = function_name.resolve(ast);
 
-	//			std::cout << funtion_ast->type->to_string();
+			if ( function_call_args.size() != function_declaration_args.size() )
+				Log(ERROR) << "Wrong number of arguments";
 
-				auto &function_call_args = ast[1]->children;
-				auto &function_declaration_args = funtion_declaration_ast->type[0][1]->children;
+			for (auto &arg : function_call_args) {
 
+				std::cout << arg.to_string();
+				process( arg );
+			}
 
-				if ( function_call_args.size() != function_declaration_args.size() )
-					Log(ERROR) << "Wrong number of arguments";
+/*			auto return_type = funtion_ast->type()[0][0][0][0];
+			if (return_type.id() != "void") {
+				oss << type_to_c(return_type) << " " << ast->generated_id() << " = ";
+			}*/
 
-				for (auto &arg : function_call_args) {
+			oss << funtion_declaration_ast->generated_id() << "( " ;
+			for ( auto &a : function_call_args ) {
 
-					std::cout << arg.to_string();
-					process( arg );
-				}
+				if ( &a != &function_call_args.front() ) oss << ", ";
+				oss << a->generated_id();
+			}
+			oss << " );" << endl;
+		}
 
-	/*			auto return_type = funtion_ast->type[0][0][0][0];
-				if (return_type.id() != "void") {
-					oss << type_to_c(return_type) << " " << ast->generated_id << " = ";
-				}*/
+		void otherwise(SyntaxTree::SP &ast) { Log(ERROR) << ast.id() << " does not have a code generator (yet)"; }
 
-				oss << funtion_declaration_ast->generated_id << "( " ;
-				for ( auto &a : function_call_args ) {
+		void process(SyntaxTree::SP &ast) { dispatch(ast); }
 
-					if ( &a != &function_call_args.front() ) oss << ", ";
-					oss << a->generated_id;
-				}
-				oss << " );" << endl;
-			}},
-		};
+	};
 
-		void process(SyntaxTree::SP &ast) {
+}
 
-			std::string symbol = ast.id();
 
-			if (processors.count(symbol)) {
-				
-				processors[symbol](ast);
+static void dump_ast_after(const std::string &pass, const SyntaxTree::SP &ast) {
 
-			} else {
+	auto &passes = GeneratorOptions::dump_ast_after();
+	if (passes.count(pass) or passes.count("all")) 
+		ast.dump(std::cout);
+}
 
-				Log(ERROR) << symbol << " does not have a code generator (yet)";
-			
+// Parses the bodies left lazy that the generated code can reach: those of the functions named by code that is reached, starting 
+// from the code outside any body. The others are only checked by the tokenizer, whose delimiters balance, unless 
+// --check-lazy-bodies asks for every body to be parsed. Names are matched by their identifier alone, so a function is also 
+// reached when another one with the same name, or a variable, is used.
+static void expand_bodies(SyntaxTree::SP &ast) {
+
+	// Only parsed with --lazy-function-bodies, or loaded so, a tree has lazy bodies.
+	if (not ParseOptions::lazy_function_bodies() and GeneratorOptions::load_ast().empty()) 
+		return;
+
+	if (ParseOptions::check_lazy_bodies()) {
+		SyntaxTree::traverse(ast, [](SyntaxTree::SP &node) { node.expand(); });
+		return;
+	}
+
+	std::unordered_set<std::string> used;
+	std::vector<std::string> newly_used;
+	std::multimap<std::string, SyntaxTree::SP *> lazy_bodies;
+	std::vector<SyntaxTree::SP *> reached_bodies;
+
+	// The name of a function is not a use of it. Parsed bodies are walked as well, lazy ones are leaves.
+	auto walk = [&](SyntaxTree::SP &root) {
+
+		std::vector<SyntaxTree::SP *> pending(1, &root);
+		while (not pending.empty()) {
+
+			SyntaxTree::SP &node = *pending.back();
+			pending.pop_back();
+			if (not node or node.kind() == Kind::function_name) continue;
+
+			if (node.kind() == Kind::IDENTIFIER and used.insert(node->first->literal).second) 
+				newly_used.push_back(node->first->literal);
+
+			if (node.kind() == Kind::function_definition) {
+				AST::FunctionDefinition definition(node);
+				SyntaxTree::SP &body = definition.function_body();
+				if (body->is_lazy) 
+					lazy_bodies.emplace(AST::FunctionName(definition.function_name()).IDENTIFIER().literal(), &body);
 			}
-		}
 
+			for (auto &c : node->children) 
+				pending.push_back(&c);
+		}
 	};
 
+	walk(ast);
+	while (true) {
+
+		for (auto &name : newly_used) {
+			auto range = lazy_bodies.equal_range(name);
+			for (auto it = range.first; it != range.second; it++) 
+				reached_bodies.push_back(it->second);
+			lazy_bodies.erase(range.first, range.second);
+		}
+		newly_used.clear();
+
+		if (reached_bodies.empty()) break;
+
+		SyntaxTree::SP &body = *reached_bodies.back();
+		reached_bodies.pop_back();
+		body.expand();
+		walk(body);
+	}
+
+	Log(INFO) << "Expand bodies: " << lazy_bodies.size() << " not reached";
 }
 
+// What modules that import the tree get, see Preprocessor::keep_declarations.
+static SyntaxTree::SP module_interface(const SyntaxTree::SP &ast, CompilerPass::Preprocessor::State &state) {
+
+	SyntaxTree::SP interface = SyntaxTree::clone(ast);
+	CompilerPass::Preprocessor(state).keep_declarations(interface, true);
+	return interface;
+}
 
 void generate_code( std::string source_file_name ) {
 
-	SourceFile &source_file = SourceFile::Manager::get(source_file_name);
+	SyntaxTree::SP main_syntax_tree;
 
-	SyntaxTree::SP main_syntax_tree = std::make_shared<SyntaxTree>( source_file );
-	
+	if (not GeneratorOptions::load_ast().empty()) {
 
-	if (main_syntax_tree.id() != "translation_unit") 
-		Log(ERROR) << "Base syntax tree isn't translation unit but: " << main_syntax_tree.id();
+		main_syntax_tree = load_syntax_tree(GeneratorOptions::load_ast());
+		if (not main_syntax_tree) 
+			Log(ERROR) << "Could not load syntax tree from " << GeneratorOptions::load_ast();
 
+	} else {
 
-	{
-		Log(INFO) << "COMPILER PASS: PREPROCESSOR";
-		CompilerPass::Preprocessor preprocessor;
-		preprocessor.process(main_syntax_tree);
-		std::cout << main_syntax_tree.to_string();
-	}
-	
-	{
-		Log(INFO) << "COMPILER PASS: SYMBOL IDENTIFICATION";
-		CompilerPass::Symbols identify_symbols;
-		identify_symbols.process(main_syntax_tree);
-		std::cout << main_syntax_tree.to_string();
-	}
+		SourceFile &source_file = SourceFile::Manager::get(source_file_name);
 
-	{
-		Log(INFO) << "COMPILER PASS: TYPE IDENTIFICATION";
-		CompilerPass::Types identify_types;
-		identify_types.process(main_syntax_tree);
-		std::cout << main_syntax_tree.to_string();
-	}
+		main_syntax_tree = std::make_shared<SyntaxTree>( source_file );
 
-	{
-		Log(INFO) << "COMPILER PASS: OPTIMIZER";
-		CompilerPass::Optimizer optimizer;
-		optimizer.process(main_syntax_tree);
-		std::cout << main_syntax_tree.to_string();
+		if (main_syntax_tree.id() != "translation_unit") 
+			Log(ERROR) << "Base syntax tree isn't translation unit but: " << main_syntax_tree.id();
 	}
 
-	{
-		Log(INFO) << "COMPILER PASS: CODE GENERATION";
-		CompilerPass::CodeGeneration code_generation;
-		code_generation.process(main_syntax_tree);
-		//std::cout << main_syntax_tree.to_string();
+	auto preprocessor_state = std::make_shared<CompilerPass::Preprocessor::State>();
+	auto code_generation = std::make_shared<CompilerPass::CodeGeneration>();
+	if (not GeneratorOptions::load_ast().empty()) 
+		CompilerPass::Preprocessor(*preprocessor_state).instantiate_loaded(main_syntax_tree);
+
+	PassManager manager;
+	manager.passes = {
+		{ "preprocessor", {}, { "preprocessed" }, [preprocessor_state](SyntaxTree::SP &ast) { CompilerPass::Preprocessor(*preprocessor_state).process(ast); }, {}, not GeneratorOptions::load_ast().empty() },
+		{ "hash_consing", { "preprocessed" }, { "hash_consed" }, [](SyntaxTree::SP &ast) { 
+			CompilerPass::HashConsing hash_consing;
+			hash_consing.process(ast);
+			Log(INFO) << "Hash consing: " << hash_consing.shared << " of " << hash_consing.expressions << " pure expressions shared";
+		}, {} },
+		{ "symbols", { "preprocessed" }, { "symbols" }, [](SyntaxTree::SP &ast) { CompilerPass::Symbols().process(ast); }, [](SyntaxTree::SP &ast) { CompilerPass::Symbols().dispatch(ast); } },
+		{ "types", { "preprocessed" }, { "types" }, [](SyntaxTree::SP &ast) { CompilerPass::Types().process(ast); }, [](SyntaxTree::SP &ast) { CompilerPass::Types().dispatch(ast); } },
+		{ "optimizer", { "symbols", "types" }, { "optimized" }, [](SyntaxTree::SP &ast) { CompilerPass::Optimizer().process(ast); }, {} },
+		// Bodies left lazy that the generated code reaches are parsed before anything is generated from the tree.
+		{ "expand_bodies", { "symbols", "types", "optimized" }, { "expanded" }, [](SyntaxTree::SP &ast) { expand_bodies(ast); }, {}, false, false },
+		{ "ir", { "expanded" }, { "ir" }, [](SyntaxTree::SP &ast) { 
+			IR::Module module = IR::build(ast);
+			IR::verify(module);
+			IR::print(std::cout, module);
+		}, {}, false, false },
+		{ "code_generation", { "expanded" }, { "code" }, [code_generation](SyntaxTree::SP &ast) { code_generation->process(ast); }, {}, false, false },
+	};
 
-		for (auto &cu : code_generation.state.code_units) {
+	// Code generation does not use the IR (yet), so it is only built when asked for.
+	if (not GeneratorOptions::emit_ir()) 
+		manager.passes.erase(std::find_if(manager.passes.begin(), manager.passes.end(), [](auto &pass) { return pass.name == "ir"; }));
+
+	for (auto &name : GeneratorOptions::dump_ast_after()) 
+		if (name != "all" and std::none_of(manager.passes.begin(), manager.passes.end(), [&](auto &pass) { return pass.name == name; })) 
+			Log(ERROR) << "Unknown pass " << name << " to dump the syntax tree after";
+
+	// A pass that is dumped ends its walk, so the dump shows it alone.
+	for (auto &pass : manager.passes) 
+		if (GeneratorOptions::dump_ast_after().count(pass.name) or GeneratorOptions::dump_ast_after().count("all")) 
+			manager.stop_after.insert(pass.name);
+
+	manager.after = [preprocessor_state](const std::string &pass, SyntaxTree::SP &ast) {
+		dump_ast_after(pass, ast);
+		if (pass == "preprocessor" and not GeneratorOptions::save_ast().empty()) 
+			save_syntax_tree(ast, GeneratorOptions::save_ast());
+		if (pass == "preprocessor" and not GeneratorOptions::emit_interface().empty()) 
+			save_syntax_tree(module_interface(ast, *preprocessor_state), GeneratorOptions::emit_interface());
+	};
 
-			Log(INFO) << cu.first;
-			std::cout << cu.second.out << std::endl;
+	try {
+		manager.run(main_syntax_tree);
+	} catch (...) {
+		if (GeneratorOptions::pass_times()) manager.print_timings(std::cerr);
+		throw;
+	}
+	if (GeneratorOptions::pass_times()) manager.print_timings(std::cerr);
 
-		}
+	for (auto &cu : code_generation->state.code_units) {
+
+		Log(INFO) << cu.first;
+		std::cout << cu.second.out << std::endl;
 	}
 }
@@ -1,5 +1,22 @@
 #pragma once
 #include <ast.h>
 
+#include <set>
+
+struct GeneratorOptions {
+	// Saves the tree after the Preprocessor pass to this file, see serialize.h
+	static std::string &save_ast() { static std::string s; return s; }
+	// Starts from a tree saved with save_ast() instead of parsing the source file
+	static std::string &load_ast() { static std::string s; return s; }
+	// Saves the interface of the compiled file to this file, for the files that import it as a module (see serialize.h)
+	static std::string &emit_interface() { static std::string s; return s; }
+	// Passes after which the tree is printed to stdout: preprocessor, hash_consing, symbols, types, optimizer, or all
+	static std::set<std::string> &dump_ast_after() { static std::set<std::string> s; return s; }
+	// Prints the time spent in each walk of the tree to stderr
+	static bool &pass_times() { static bool b = false; return b; }
+	// Lowers the tree to the SSA IR, verifies it and prints it to stdout, see ir.h
+	static bool &emit_ir() { static bool b = false; return b; }
+};
+
 void generate_code( std::string source_file_name );
 
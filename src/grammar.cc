@@ -1,12 +1,19 @@
 #include "grammar.h"
 
 #include <set>
+#include <algorithm>
 
 extern char ext_grammar[];
 
 Grammar::Grammar() {	
 
 	std::istringstream iss(ext_grammar);
+	load(iss);
+	resolve();
+}
+
+void Grammar::load(std::istream &iss) {
+
 	std::string s;
 
 	// Parse the first section. Fill reserved_keyword lists and magic token lists. 
@@ -32,6 +39,12 @@ Grammar::Grammar() {
 				if (s == ";") break;
 				magic_tokens.insert(s);
 			}
+		} else if (s == "%kind") {
+			// add node kinds that are not in the grammar
+			while (iss >> s) {
+				if (s == ";") break;
+				extra_kinds.insert(s);
+			}
 		} else {
 			Log(ERROR) << "Unknown directive in first grammar section: " << s;
 		}
@@ -48,9 +61,12 @@ Grammar::Grammar() {
 		} 
 
 		bool is_weak = false;
+		bool is_list = false;
 		while (s.front()=='%') {
 			if (s == "%weak") {
 				is_weak = true;
+			} else if (s == "%list") {
+				is_list = true;
 			} else {
 				Log(ERROR) << "Unknown directive in second grammar section: " << s;
 			}
@@ -61,8 +77,9 @@ Grammar::Grammar() {
 
 		Symbol &symbol = symbols[s];
 		std::string symbol_name = s;
-		//symbol.name = s;
+		symbol.name = s;
 		symbol.is_weak = is_weak;
+		symbol.is_list = is_list;
 		is_weak = false;
 
 		// Consume ':'
@@ -100,6 +117,7 @@ Grammar::Grammar() {
 						Log(ERROR) << "Sub symbol " << subsymbol_name << " within " << symbol_name << "already exists";
 
 					Symbol &subsymbol = symbols[phony_component.id()];
+					subsymbol.name = subsymbol_name;
 					subsymbol.is_weak = false;
 
 					for (auto &recipe : recipes) {
@@ -168,4 +186,283 @@ Grammar::Grammar() {
 	}
 }
 
+uint16_t Grammar::kind_of(const std::string &id) {
+
+	auto it = kind_table().find(id);
+	return it == kind_table().end() ? 0 : it->second;
+}
+
+// left_corner[a][b]: a can derive a sequence starting with b without consuming tokens (there are no empty recipes).
+std::vector<std::vector<bool>> Grammar::left_corners() const {
+
+	size_t N = symbol_list.size();
+	std::vector<std::vector<bool>> left_corner(N, std::vector<bool>(N, false));
+	for (auto symbol : symbol_list) 
+		for (auto &recipe : symbol->recipes)
+			if (recipe.front().index() >= 0) 
+				left_corner[symbol->index][recipe.front().index()] = true;
+
+	for (size_t k = 0; k < N; k++) 
+		for (size_t i = 0; i < N; i++) 
+			if (left_corner[i][k])
+				for (size_t j = 0; j < N; j++) 
+					if (left_corner[k][j]) 
+						left_corner[i][j] = true;
+
+	return left_corner;
+}
+
+// Numbers the symbols, resolves recipe components to symbol indices, and classifies left-recursive recipes.
+void Grammar::resolve() {
+
+	for (auto &[name, symbol] : symbols) {
+		symbol.index = symbol_list.size();
+		symbol_list.push_back(&symbol);
+	}
+
+	for (auto symbol : symbol_list) 
+		for (auto &recipe : symbol->recipes)
+			for (auto &component : recipe)
+				if (component.is_symbol() and symbols.count(component.id()))
+					component.index_ = symbols[component.id()].index;
+
+	std::set<std::string> kinds = extra_kinds;
+	for (auto symbol : symbol_list) {
+		kinds.insert(symbol->name);
+		for (auto &recipe : symbol->recipes)
+			for (auto &component : recipe)
+				kinds.insert(component.id());
+	}
+	kind_names.assign(1, "");
+	kind_names.insert(kind_names.end(), kinds.begin(), kinds.end());
+	if (kind_table().empty()) 
+		for (size_t i = 1; i < kind_names.size(); i++) 
+			kind_table()[kind_names[i]] = i;
+
+	for (auto symbol : symbol_list) 
+		for (auto &recipe : symbol->recipes)
+			for (auto &component : recipe)
+				component.kind_ = kind_of(component.id());
+
+	auto left_corner = left_corners();
+
+	for (auto symbol : symbol_list) {
+		for (auto &recipe : symbol->recipes) {
+			int front = recipe.front().index();
+			if (front < 0) 
+				symbol->left_recursion.push_back(Symbol::NOT_LEFT_RECURSIVE);
+			else if (size_t(front) == symbol->index) 
+				symbol->left_recursion.push_back(Symbol::DIRECT);
+			else if (left_corner[front][symbol->index]) 
+				symbol->left_recursion.push_back(Symbol::INDIRECT);
+			else 
+				symbol->left_recursion.push_back(Symbol::NOT_LEFT_RECURSIVE);
+
+			// list nodes are grown in place, which is only safe while no other symbol can hold them as a seed.
+			if (symbol->is_list and symbol->left_recursion.back() == Symbol::INDIRECT)
+				Log(ERROR) << "List symbol " << symbol->name << " can not be indirectly left recursive";
+		}
+	}
+}
+
+size_t Grammar::analyze(std::ostream &os) const {
+
+	size_t problems = 0;
+	size_t N = symbol_list.size();
+
+	auto component_to_string = [](const Symbol::Component &c) { return c.is_token() ? "'" + c.id() + "'" : c.id(); };
+	auto recipe_to_string = [&](const std::vector<Symbol::Component> &recipe) {
+		std::string ret;
+		for (auto &c : recipe) {
+			if (not ret.empty()) ret += " ";
+			ret += component_to_string(c);
+		}
+		return ret;
+	};
+
+	// Undefined symbols: referenced in a recipe, but neither defined nor a leaf.
+	os << "# Undefined symbols\n";
+	for (auto symbol : symbol_list) 
+		for (auto &recipe : symbol->recipes)
+			for (auto &c : recipe)
+				if (c.is_symbol() and c.index() < 0 and magic_tokens.count(c.id()) == 0) {
+					os << "  " << c.id() << " in " << symbol->name << "\n";
+					problems++;
+				}
+
+	// Duplicate recipes: each copy is parsed again, and every tree it produces is reported as ambiguous.
+	os << "# Duplicate recipes\n";
+	for (auto symbol : symbol_list) {
+		auto &recipes = symbol->recipes;
+		for (size_t i = 0; i < recipes.size(); i++) {
+			for (size_t j = 0; j < i; j++) {
+				bool same = recipes[i].size() == recipes[j].size();
+				for (size_t k = 0; same and k < recipes[i].size(); k++) {
+					auto &a = recipes[i][k], &b = recipes[j][k];
+					same = a.id() == b.id() and a.is_token() == b.is_token() and a.force_root == b.force_root and a.must_keep == b.must_keep;
+				}
+				if (same) {
+					os << "  " << symbol->name << " : " << recipe_to_string(recipes[i]) << "\n";
+					problems++;
+					break;
+				}
+			}
+		}
+	}
+
+	// Unreachable symbols from 'start'.
+	os << "# Unreachable symbols\n";
+	{
+		std::vector<bool> reachable(N, false);
+		std::vector<size_t> pending;
+		if (symbols.count("start")) {
+			pending.push_back(symbols.at("start").index);
+			reachable[pending.back()] = true;
+		}
+		while (not pending.empty()) {
+			auto symbol = symbol_list[pending.back()];
+			pending.pop_back();
+			for (auto &recipe : symbol->recipes)
+				for (auto &c : recipe)
+					if (c.index() >= 0 and not reachable[c.index()]) {
+						reachable[c.index()] = true;
+						pending.push_back(c.index());
+					}
+		}
+		for (auto symbol : symbol_list) 
+			if (not reachable[symbol->index]) {
+				os << "  " << symbol->name << "\n";
+				problems++;
+			}
+	}
+
+	// Nullable symbols: the parser assumes every recipe consumes at least one token.
+	os << "# Nullable symbols\n";
+	{
+		std::vector<bool> nullable(N, false);
+		for (bool changed = true; changed; ) {
+			changed = false;
+			for (auto symbol : symbol_list) {
+				if (nullable[symbol->index]) continue;
+				for (auto &recipe : symbol->recipes) {
+					bool all_nullable = true;
+					for (auto &c : recipe) 
+						all_nullable = all_nullable and c.index() >= 0 and nullable[c.index()];
+					if (all_nullable) {
+						nullable[symbol->index] = changed = true;
+						break;
+					}
+				}
+			}
+		}
+		for (auto symbol : symbol_list) 
+			if (nullable[symbol->index]) {
+				os << "  " << symbol->name << "\n";
+				problems++;
+			}
+	}
+
+	// Left recursion: direct recursion is cheap, indirect recursion is grown through the intermediate symbols.
+	// The alternatives of an indirectly left recursive symbol that do not lead back to it are parsed again at every growth step.
+	auto left_corner = left_corners();
+	os << "# Left recursion\n";
+	for (auto symbol : symbol_list) {
+		auto &recipes = symbol->recipes;
+		bool indirect = false;
+		for (size_t r = 0; r < recipes.size(); r++) {
+			if (symbol->left_recursion[r] == Symbol::NOT_LEFT_RECURSIVE) continue;
+			os << "  " << symbol->name << " : " << recipe_to_string(recipes[r]) 
+				<< (symbol->left_recursion[r] == Symbol::DIRECT ? "  (direct)" : "  (indirect)") << "\n";
+			indirect = indirect or symbol->left_recursion[r] == Symbol::INDIRECT;
+		}
+		if (not indirect) continue;
+
+		for (auto &recipe : recipes) {
+			int front = recipe.front().index();
+			if (front >= 0 and (size_t(front) == symbol->index or left_corner[front][symbol->index])) continue;
+			os << "    mixed: " << symbol->name << " : " << recipe_to_string(recipe) << " does not lead back to " << symbol->name << "\n";
+		}
+	}
+	for (auto symbol : symbol_list) {
+		if (not symbol->is_list) continue;
+		if (std::count(symbol->left_recursion.begin(), symbol->left_recursion.end(), Symbol::DIRECT) == 0) {
+			os << "  %list " << symbol->name << " has no directly left recursive recipe\n";
+			problems++;
+		}
+	}
+
+	// FIRST sets. Terminals are quoted tokens and the IDENTIFIER, CONSTANT and STRING_LITERAL leaves.
+	// A token that looks like an identifier and is not reserved can also be parsed as an IDENTIFIER.
+	std::vector<std::set<std::string>> first(N);
+	auto first_of = [&](const Symbol::Component &c) {
+		if (c.index() >= 0) return first[c.index()];
+		return std::set<std::string>{ component_to_string(c) };
+	};
+	for (bool changed = true; changed; ) {
+		changed = false;
+		for (auto symbol : symbol_list) 
+			for (auto &recipe : symbol->recipes) 
+				for (auto &t : first_of(recipe.front())) 
+					changed = first[symbol->index].insert(t).second or changed;
+	}
+
+	auto overlap = [&](const std::set<std::string> &a, const std::set<std::string> &b) {
+		auto is_identifier_like = [&](const std::string &t) {
+			return t.size() > 2 and t.front() == '\'' and (std::isalpha(t[1]) or t[1] == '_') and reserved_keywords.count(t.substr(1, t.size() - 2)) == 0;
+		};
+		std::set<std::string> ret;
+		for (auto &t : a) {
+			if (b.count(t)) ret.insert(t);
+			if (is_identifier_like(t) and b.count("IDENTIFIER")) ret.insert(t + "/IDENTIFIER");
+			if (t == "IDENTIFIER") for (auto &u : b) if (is_identifier_like(u)) ret.insert(u + "/IDENTIFIER");
+		}
+		return ret;
+	};
+
+	os << "# FIRST/FIRST conflicts (recipes of a symbol that can start with the same token)\n";
+	for (auto symbol : symbol_list) {
+		auto &recipes = symbol->recipes;
+		for (size_t i = 0; i < recipes.size(); i++) {
+			if (symbol->left_recursion[i] == Symbol::DIRECT) continue;
+			for (size_t j = 0; j < i; j++) {
+				if (symbol->left_recursion[j] == Symbol::DIRECT) continue;
+				auto common = overlap(first_of(recipes[j].front()), first_of(recipes[i].front()));
+				if (common.empty()) continue;
+				os << "  " << symbol->name << " : " << recipe_to_string(recipes[j]) << "  |  " << recipe_to_string(recipes[i]) << "  on";
+				size_t n = 0;
+				for (auto &t : common) 
+					if (n++ < 6) os << " " << t;
+				if (common.size() > 6) os << " ... (" << common.size() << ")";
+				os << "\n";
+			}
+		}
+	}
+
+	// Branching factor: for each token that can start a symbol, how many of its recipes have to be tried.
+	os << "# Branching factor per symbol (recipes tried per starting token: average, maximum, worst token)\n";
+	{
+		struct Branching { std::string name; double average; size_t maximum; std::string worst; };
+		std::vector<Branching> branching;
+		for (auto symbol : symbol_list) {
+			Branching b{ symbol->name, 0, 0, "" };
+			for (auto &t : first[symbol->index]) {
+				size_t n = 0;
+				for (size_t r = 0; r < symbol->recipes.size(); r++) 
+					if (symbol->left_recursion[r] != Symbol::DIRECT and not overlap({t}, first_of(symbol->recipes[r].front())).empty()) 
+						n++;
+				b.average += n;
+				if (n > b.maximum) { b.maximum = n; b.worst = t; }
+			}
+			if (not first[symbol->index].empty()) b.average /= first[symbol->index].size();
+			branching.push_back(b);
+		}
+		std::sort(branching.begin(), branching.end(), [](auto &a, auto &b) { return a.maximum != b.maximum ? a.maximum > b.maximum : a.average > b.average; });
+		for (auto &b : branching) 
+			os << std::setw(8) << std::fixed << std::setprecision(2) << b.average << std::setw(4) << b.maximum << "  " << b.name << "  " << b.worst << "\n";
+	}
+
+	os << problems << " problems found\n";
+	return problems;
+}
+
 asm("ext_grammar:    .incbin \"grammar.y\" \n .balign 1 \n .byte 0x00\n");
@@ -9,32 +9,75 @@ struct Grammar {
 
 	// A grammar symbol can be build from one of many possible recipes.
 	struct Symbol {
+
+		std::string name;
 		
 		// Weak symbols can be removed while parsing the tree if they have less than two children
 		bool is_weak;
+
+		// List symbols repeat their left-recursive recipes greedily, appending to a single node in place.
+		bool is_list = false;
+
+		// Position of the symbol in Grammar::symbol_list
+		size_t index = 0;
 		
 		// Each symbol recipe is a list of different components
 		struct Component {
 		private:
 			enum { SYMBOL, TOKEN } type;
 			std::string id_;
+			int index_ = -1;
+			uint16_t kind_ = 0;
+			friend struct Grammar;
 		public:
 			bool force_root = false;
 			bool must_keep = false;
 			
-			static Component Symbol(std::string s) { Component c; c.id_ = s; c.type = SYMBOL; return c; }
-			static Component Token(std::string s) { Component c; c.id_ = s; c.type = TOKEN; return c; }
+			static Component Symbol(std::string s) { Component c; c.id_ = s; c.type = SYMBOL; c.kind_ = Grammar::kind_of(s); return c; }
+			static Component Token(std::string s) { Component c; c.id_ = s; c.type = TOKEN; c.kind_ = Grammar::kind_of(s); return c; }
+
+			// The node a token (or a leaf) becomes when it is kept or used as a root.
+			Component as_symbol() const { Component c; c.id_ = id_; c.type = SYMBOL; c.kind_ = kind_; return c; }
 
 			const std::string &id() const { return id_; } 
 			bool is_symbol() const { return type == SYMBOL;}
 			bool is_token() const { return type == TOKEN;}
+
+			// Index of the grammar symbol in Grammar::symbol_list, or -1 if unresolved (tokens, leaves, and components built at run time).
+			int index() const { return index_; }
+
+			// Node kind of the id, see Grammar::kind_names. 0 if the id is not known to the grammar.
+			uint16_t kind() const { return kind_; }
 		};
 		std::vector<std::vector<Component>> recipes;
+
+		// A recipe is left recursive if its first component is the symbol itself (DIRECT), or can start with it (INDIRECT).
+		enum LeftRecursion { NOT_LEFT_RECURSIVE, DIRECT, INDIRECT };
+		std::vector<LeftRecursion> left_recursion;
 	};
 	
-	std::set<std::string> reserved_keywords, magic_tokens;
+	std::set<std::string> reserved_keywords, magic_tokens, extra_kinds;
 
 	std::map<std::string, Symbol> symbols;
+	std::vector<Symbol *> symbol_list;
+
+	const Symbol &get(const Symbol::Component &component) const { 
+		return component.index() >= 0 ? *symbol_list[component.index()] : symbols.at(component.id()); 
+	}
 	
+	// Node kinds: every id a tree node can get (symbols, tokens, leaves and %kind), sorted and numbered from 1.
+	// kind_names[0] is the empty name of unknown ids. The generated grammar_kinds.h enumerates them in the same order.
+	std::vector<std::string> kind_names;
+	static uint16_t kind_of(const std::string &id);
+
 	Grammar();
+
+	// Reports grammar problems that cost parse time or correctness. Returns the number of problems that should be fixed.
+	size_t analyze(std::ostream &os) const;
+
+private:
+	static std::map<std::string, uint16_t> &kind_table() { static std::map<std::string, uint16_t> table; return table; }
+	std::vector<std::vector<bool>> left_corners() const;
+	void load(std::istream &iss);
+	void resolve();
 };
@@ -5,6 +5,7 @@
 // # 
 // # %opt <term> : <term> may be ommited
 // # %weak <symbol>: if <symbol> has only one child, it can be reduced while parsing.
+// # %list <symbol>: left-recursive recipes of <symbol> are repeated greedily into a single node.
 // # %label <name>: if the recipe is accepted, the tree will be labeled with <name> 
 // # %root <term> : <term> will replace the symbol at the root of the tree 
 // # 
@@ -16,15 +17,18 @@
      auto bitand bitor bool break case catch char char8_t char16_t char32_t class compl concept  const
 	 consteval constexpr constinit const_cast continue co_await co_return co_yield decltype default
 	 delete do double dynamic_cast else enum explicit export extern false float for friend function
-	 goto if in inline int long mutable namespace new noexcept not not_eq nullptr operator or or_eq
+	 goto if import in inline int long mutable namespace new noexcept not not_eq nullptr operator or or_eq
 	 private protected public reflexpr register reinterpret_cast requires return short signed sizeof
 	 static static_assert static_cast struct switch synchronized template this thread_local throw true
 	 try typedef typeid typeof typename union unsigned using virtual void volatile wchar_t while xor
-	 xor_eq uint8 uint16 int8 int16;
+	 xor_eq uint8 uint16 int8 int16 ;
 
 // Key Tokens
 %token IDENTIFIER CONSTANT STRING_LITERAL ;
 
+// Node kinds created by the compiler passes
+%kind included_scope instance_declaration ;
+
 %%
 
 // ########################################################################
@@ -51,6 +55,7 @@ postfix_expression
 	| postfix_expression %root '.' IDENTIFIER
 	;
 
+%list
 argument_expression_list
 	: expression
 	| argument_expression_list ',' expression
@@ -101,8 +106,8 @@ relational_expression
 	: shift_expression
 	| relational_expression %root '<' shift_expression
 	| relational_expression %root '>' shift_expression
-	| relational_expression %root '<' shift_expression
-	| relational_expression %root '>' shift_expression
+	| relational_expression %root '<=' shift_expression
+	| relational_expression %root '>=' shift_expression
 	;
 
 %weak
@@ -168,6 +173,7 @@ init_declaration
 	| IDENTIFIER %root '=' initializer 
 	;
 
+%list
 init_declarator_list
 	: init_declaration
 	| init_declarator_list ',' init_declaration
@@ -179,7 +185,7 @@ initializer
 	| '{' initializer_list %opt ',' '}'
 	;
 
-%weak
+%weak %list
 initializer_list
 	: initializer
 	| initializer_list ',' initializer
@@ -195,12 +201,34 @@ type_name
 	| %label 'array' type_name '[' %opt CONSTANT ']'
 	| %label 'struct' 'struct' '{' %opt translation_unit '}' 
 	| %label 'union' 'union' '{' %opt translation_unit '}' 
+	| %label 'generic_struct' 'struct' '<' template_parameter_list '>' '{' %opt translation_unit '}' 
+	| %label 'template_instance' namespaced_identifier '#' '<' template_argument_list '>'
+	| template_parameter
 	| %label 'typeof'  'typeof' '(' expression ')'
 	| function_declaration
 	| %label 'bit_field' type_name ':' CONSTANT
 	| type_name attribute_section 
 	;
 
+// ########################################################################
+// # TEMPLATES
+// struct<#T, #U> { ... } is a generic struct, and #T the type it is given for T. Generic structs are named with typedef, 
+// and instantiated as Name#<type, ...>, see the Preprocessor.
+
+template_parameter : '#' IDENTIFIER ;
+
+%list
+template_parameter_list
+	: template_parameter
+	| template_parameter_list ',' template_parameter
+	;
+
+%list
+template_argument_list
+	: type_name
+	| template_argument_list ',' type_name
+	;
+
 // ########################################################################
 // # ATTRIBUTES
 
@@ -211,6 +239,7 @@ attribute
 	| %root IDENTIFIER
 	;
 
+%list
 attributes
 	: attribute
 	| attributes ',' attribute
@@ -229,6 +258,7 @@ statement
 	: '{' %opt translation_unit '}'
 	| ';'
 	| function_definition_with_implicit_type
+	| %label 'function_prototype' function_return_type function_name function_parameter_list_scoped %opt attribute_section ';'
 	| expression ';'
 	| %root 'if' '(' expression ')' translation_unit_single
 	| %root 'if' '(' expression ')' translation_unit_single 'else' translation_unit_single
@@ -244,6 +274,8 @@ statement
 	| %root 'auto' init_declaration ';'
 	| %root 'typedef' type_name IDENTIFIER ';'
 	| %root 'include' STRING_LITERAL
+	| %root 'import' IDENTIFIER ';'
+	| %label 'once_directive' '%' IDENTIFIER
 	| %root 'namespace' IDENTIFIER '{' %opt translation_unit '}'
 	;
 
@@ -266,6 +298,7 @@ function_parameter_declaration
 	;
 
 
+%list
 function_parameter_list
 	: function_parameter_declaration
 	| function_parameter_list ',' function_parameter_declaration
@@ -286,6 +319,7 @@ function_declaration : 'function' '[' function_return_type function_parameter_li
 
 translation_unit_single : statement ;
 
+%list
 translation_unit
 	: statement
 	| translation_unit statement
@@ -0,0 +1,1159 @@
+#include "ir.h"
+#include "types.h"
+#include <grammar_views.h>
+#include <grammar_visitor.h>
+
+#include <unordered_map>
+#include <algorithm>
+
+
+namespace IR {
+
+	const char *name(Type type) {
+		switch (type) {
+			case Type::VOID: return "void";
+			case Type::I8: return "i8";
+			case Type::I16: return "i16";
+		}
+		return "?";
+	}
+
+	const char *name(Op op) {
+		switch (op) {
+			case Op::UNDEF: return "undef";
+			case Op::CONST: return "const";
+			case Op::PARAM: return "param";
+			case Op::PHI: return "phi";
+			case Op::LOAD: return "load";
+			case Op::STORE: return "store";
+			case Op::ADD: return "add";
+			case Op::SUB: return "sub";
+			case Op::MUL: return "mul";
+			case Op::UDIV: return "udiv";
+			case Op::SDIV: return "sdiv";
+			case Op::UREM: return "urem";
+			case Op::SREM: return "srem";
+			case Op::SHL: return "shl";
+			case Op::LSHR: return "lshr";
+			case Op::ASHR: return "ashr";
+			case Op::AND: return "and";
+			case Op::OR: return "or";
+			case Op::XOR: return "xor";
+			case Op::NEG: return "neg";
+			case Op::NOT: return "not";
+			case Op::EQ: return "eq";
+			case Op::NE: return "ne";
+			case Op::ULT: return "ult";
+			case Op::SLT: return "slt";
+			case Op::ULE: return "ule";
+			case Op::SLE: return "sle";
+			case Op::ZEXT: return "zext";
+			case Op::SEXT: return "sext";
+			case Op::TRUNC: return "trunc";
+			case Op::CALL: return "call";
+			case Op::JMP: return "jmp";
+			case Op::BR: return "br";
+			case Op::RET: return "ret";
+		}
+		return "?";
+	}
+
+	static int bits(Type type) { return type == Type::I8 ? 8 : type == Type::I16 ? 16 : 0; }
+
+
+	/////////////////////////////////////////////////////////////////
+	// BUILDER
+	// Local variables become SSA values as the tree is lowered, following Braun et al., "Simple and Efficient Construction of
+	// Static Single Assignment Form": each block remembers the last value of each variable, and reading one that a block does not
+	// define looks it up in its predecessors, through a phi if there are several. Blocks are sealed once all their predecessors
+	// are known; until then their phis are left incomplete.
+	struct Builder : AST::Visitor<Builder> {
+
+		// Registers have no signedness, the operations that use them do. Types have it, so values keep it for the builder.
+		struct Value { Reg reg = NONE; Type type = Type::VOID; bool is_signed = false; };
+
+		struct Symbol {
+			enum { LOCAL, GLOBAL, FUNCTION } kind;
+			uint32_t index;
+			uint32_t function; // that a LOCAL belongs to
+		};
+
+		struct Scope {
+			std::map<std::string, Symbol> symbols;
+			bool module; // namespaces and the top level: their variables are globals
+		};
+
+		struct Signature { Value ret; std::vector<Value> params; };
+
+		struct Frame {
+			uint32_t function = 0, block = 0;
+			Value ret;
+			std::vector<Value> vars;
+			std::vector<std::unordered_map<uint32_t, Reg>> current_def; // by block, then variable
+			std::vector<std::vector<std::pair<uint32_t, uint32_t>>> incomplete; // by block: variable and phi of unsealed blocks
+			std::vector<bool> sealed;
+			std::vector<std::pair<uint32_t, uint32_t>> loops; // continue and break targets
+		};
+
+		Module module;
+		std::vector<Signature> signatures;
+		std::vector<Scope> scopes;
+		std::string prefix; // of the current namespaces
+		Frame fr;
+
+		Function &f() { return module.functions[fr.function]; }
+
+		/////////////////////////////////////////////////////////////////
+		// EMISSION
+		Reg new_reg(Type type) { f().regs.push_back(type); return Reg(f().regs.size() - 1); }
+
+		Reg emit(Op op, Type type, const std::vector<Reg> &args = {}, int64_t imm = 0) {
+
+			Instr i{ op, type, type == Type::VOID ? NONE : new_reg(type), uint32_t(f().operands.size()), uint32_t(args.size()), imm };
+			f().operands.insert(f().operands.end(), args.begin(), args.end());
+			f().blocks[fr.block].code.push_back(i);
+			return i.dst;
+		}
+
+		uint32_t new_block() {
+
+			f().blocks.emplace_back();
+			fr.current_def.emplace_back();
+			fr.incomplete.emplace_back();
+			fr.sealed.push_back(false);
+			return uint32_t(f().blocks.size() - 1);
+		}
+
+		// Ends the current block. Whatever follows is unreachable, and goes to a new block that is removed at the end.
+		void terminate(Op op, const std::vector<Reg> &args, const std::vector<uint32_t> &succs) {
+
+			emit(op, Type::VOID, args);
+			for (auto s : succs) {
+				f().blocks[fr.block].succs.push_back(s);
+				f().blocks[s].preds.push_back(fr.block);
+			}
+			fr.block = new_block();
+			seal(fr.block);
+		}
+
+		void jump(uint32_t target) { terminate(Op::JMP, {}, { target }); }
+		void branch(Value cond, uint32_t then, uint32_t other) { terminate(Op::BR, { cond.reg }, { then, other }); }
+
+		Reg undef(Type type) {
+
+			Reg r = new_reg(type);
+			auto &entry = f().blocks[0].code;
+			entry.insert(entry.begin(), Instr{ Op::UNDEF, type, r, 0, 0, 0 });
+			return r;
+		}
+
+		/////////////////////////////////////////////////////////////////
+		// SSA CONSTRUCTION
+		void write(uint32_t var, uint32_t block, Reg value) { fr.current_def[block][var] = value; }
+
+		Reg read(uint32_t var, uint32_t block) {
+
+			auto it = fr.current_def[block].find(var);
+			if (it != fr.current_def[block].end()) return it->second;
+
+			Reg value;
+			auto &preds = f().blocks[block].preds;
+			if (not fr.sealed[block]) {
+				value = new_phi(var, block);
+				fr.incomplete[block].emplace_back(var, uint32_t(f().blocks[block].phis.size() - 1));
+			} else if (preds.size() == 1) {
+				value = read(var, preds.front());
+			} else if (preds.empty()) {
+				value = undef(fr.vars[var].type);
+			} else {
+				value = new_phi(var, block);
+				write(var, block, value);
+				fill_phi(var, block, uint32_t(f().blocks[block].phis.size() - 1));
+			}
+			write(var, block, value);
+			return value;
+		}
+
+		Reg new_phi(uint32_t var, uint32_t block) {
+
+			Reg r = new_reg(fr.vars[var].type);
+			f().blocks[block].phis.push_back(Instr{ Op::PHI, fr.vars[var].type, r, 0, 0, 0 });
+			return r;
+		}
+
+		void fill_phi(uint32_t var, uint32_t block, uint32_t phi) {
+
+			std::vector<Reg> args;
+			for (size_t i = 0; i < f().blocks[block].preds.size(); i++)
+				args.push_back(read(var, f().blocks[block].preds[i]));
+
+			auto &instr = f().blocks[block].phis[phi];
+			instr.args = uint32_t(f().operands.size());
+			instr.n_args = uint32_t(args.size());
+			f().operands.insert(f().operands.end(), args.begin(), args.end());
+		}
+
+		void seal(uint32_t block) {
+
+			for (auto [var, phi] : fr.incomplete[block])
+				fill_phi(var, block, phi);
+			fr.incomplete[block].clear();
+			fr.sealed[block] = true;
+		}
+
+		uint32_t new_var(Value type) { fr.vars.push_back(type); return uint32_t(fr.vars.size() - 1); }
+
+		/////////////////////////////////////////////////////////////////
+		// TYPES AND NAMES
+		Value scalar(SyntaxTree::SP &type_name) {
+
+			auto &types = TypeTable::global();
+			const ::Type *type = types.of(type_name);
+			if (type == types.void_type()) return { NONE, Type::VOID, false };
+			if (type and type->type_class == ::Type::INTEGER) return { NONE, type->size == 1 ? Type::I8 : Type::I16, type->is_signed };
+			type_name.log(ERROR) << "Type is not supported by the IR (yet)"; throw;
+		}
+
+		Value convert(Value v, Value to, const SyntaxTree::SP &ast) {
+
+			if (v.type == Type::VOID or to.type == Type::VOID)
+				ast.log(ERROR) << "Void value in an expression";
+			if (bits(v.type) < bits(to.type))
+				v.reg = emit(v.is_signed ? Op::SEXT : Op::ZEXT, to.type, { v.reg });
+			else if (bits(v.type) > bits(to.type))
+				v.reg = emit(Op::TRUNC, to.type, { v.reg });
+			return { v.reg, to.type, to.is_signed };
+		}
+
+		Symbol resolve(SyntaxTree::SP &namespaced_identifier) {
+
+			std::string name;
+			for (auto &c : namespaced_identifier->children)
+				name += (name.empty() ? "" : "::") + c->first->literal;
+
+			for (auto s = scopes.rbegin(); s != scopes.rend(); s++) {
+				auto it = s->symbols.find(name);
+				if (it == s->symbols.end()) continue;
+				if (it->second.kind == Symbol::LOCAL and it->second.function != fr.function)
+					namespaced_identifier.log(ERROR) << "Variables of enclosing functions can not be used";
+				return it->second;
+			}
+			namespaced_identifier.log(ERROR) << "Symbol " << name << " not found"; throw;
+		}
+
+		void declare(const std::string &name, Symbol symbol) { scopes.back().symbols[name] = symbol; }
+
+		/////////////////////////////////////////////////////////////////
+		// EXPRESSIONS
+		// Their handlers leave the value in result. Constants get the type in constant_type, if any, or else the narrowest that fits.
+		Value result;
+		const Value *constant_type = nullptr;
+
+		Value value(SyntaxTree::SP &ast, const Value *like = nullptr) {
+
+			auto saved = constant_type;
+			constant_type = like;
+			dispatch(ast);
+			constant_type = saved;
+			return result;
+		}
+
+		void on_expression(SyntaxTree::SP &ast) { value(AST::Expression(ast).assignment_expression(), constant_type); }
+
+		void on_CONSTANT(SyntaxTree::SP &ast) {
+
+			uint64_t val = ast->first->val;
+			if (val > 0xFFFF) ast.log(ERROR) << "Constant does not fit in 16 bits";
+			Value v = constant_type ? *constant_type : Value{ NONE, val > 0xFF ? Type::I16 : Type::I8, false };
+			if (bits(v.type) == 8 and val > 0xFF) v.type = Type::I16;
+			v.reg = emit(Op::CONST, v.type, {}, int64_t(val));
+			result = v;
+		}
+
+		void on_namespaced_identifier(SyntaxTree::SP &ast) {
+
+			Symbol s = resolve(ast);
+			if (s.kind == Symbol::FUNCTION) ast.log(ERROR) << "Functions can only be called";
+			result = target(ast);
+			result.reg = s.kind == Symbol::LOCAL ? read(s.index, fr.block) : emit(Op::LOAD, result.type, {}, s.index);
+		}
+
+		// Chains of the same operator are a single node, they associate to the left.
+		// Constants take the type of the other operand, they have no side effects to reorder.
+		void binary_expression(SyntaxTree::SP &ast) {
+
+			Value a, b;
+			if (ast[0].kind() == Kind::CONSTANT and ast[1].kind() != Kind::CONSTANT) {
+				b = value(ast[1]);
+				a = value(ast[0], &b);
+			} else {
+				a = value(ast[0]);
+				b = value(ast[1], &a);
+			}
+			a = binary(ast.kind(), a, b, ast);
+			for (size_t i = 2; i < ast->children.size(); i++)
+				a = binary(ast.kind(), a, value(ast[i], &a), ast);
+			result = a;
+		}
+
+		void on_op_star(SyntaxTree::SP &ast) { binary_expression(ast); }
+		void on_op_slash(SyntaxTree::SP &ast) { binary_expression(ast); }
+		void on_op_percent(SyntaxTree::SP &ast) { binary_expression(ast); }
+		void on_op_plus(SyntaxTree::SP &ast) { binary_expression(ast); }
+		void on_op_minus(SyntaxTree::SP &ast) { binary_expression(ast); }
+		void on_op_lt_lt(SyntaxTree::SP &ast) { binary_expression(ast); }
+		void on_op_gt_gt(SyntaxTree::SP &ast) { binary_expression(ast); }
+		void on_op_amp(SyntaxTree::SP &ast) { binary_expression(ast); }
+		void on_op_caret(SyntaxTree::SP &ast) { binary_expression(ast); }
+		void on_op_pipe(SyntaxTree::SP &ast) { binary_expression(ast); }
+		void on_op_lt(SyntaxTree::SP &ast) { binary_expression(ast); }
+		void on_op_gt(SyntaxTree::SP &ast) { binary_expression(ast); }
+		void on_op_lt_eq(SyntaxTree::SP &ast) { binary_expression(ast); }
+		void on_op_gt_eq(SyntaxTree::SP &ast) { binary_expression(ast); }
+		void on_op_eq_eq(SyntaxTree::SP &ast) { binary_expression(ast); }
+		void on_op_not_eq(SyntaxTree::SP &ast) { binary_expression(ast); }
+
+		// Short circuit: each operand is only evaluated if the ones before it do not decide.
+		void logical_expression(SyntaxTree::SP &ast, bool is_and) {
+
+			uint32_t var = new_var({ NONE, Type::I8, false }), end = new_block();
+			Value v = value(ast[0]);
+			write(var, fr.block, test(v));
+			for (size_t i = 1; i < ast->children.size(); i++) {
+				uint32_t next = new_block();
+				if (is_and) branch(v, next, end); else branch(v, end, next);
+				seal(next);
+				fr.block = next;
+				v = value(ast[i]);
+				write(var, fr.block, test(v));
+			}
+			jump(end);
+			seal(end);
+			fr.block = end;
+			result = { read(var, end), Type::I8, false };
+		}
+
+		void on_kw_and(SyntaxTree::SP &ast) { logical_expression(ast, true); }
+		void on_kw_or(SyntaxTree::SP &ast) { logical_expression(ast, false); }
+
+		void on_op_question(SyntaxTree::SP &ast) {
+
+			AST::OpQuestion conditional(ast);
+			Value c = value(conditional.logical_or_expression());
+			uint32_t then = new_block(), otherwise_block = new_block(), end = new_block();
+			branch(c, then, otherwise_block);
+			seal(then); 
+			seal(otherwise_block);
+
+			fr.block = then;
+			Value a = value(conditional.expression());
+			uint32_t then_end = fr.block;
+			jump(end);
+
+			fr.block = otherwise_block;
+			Value b = value(conditional.conditional_expression(), &a);
+			Value to = common(a, b);
+			uint32_t var = new_var(to);
+			write(var, fr.block, convert(b, to, ast).reg);
+			jump(end);
+
+			// The then branch is converted once the type of the else branch is known, right before its jump.
+			auto &code = f().blocks[then_end].code;
+			Instr jmp = code.back();
+			code.pop_back();
+			std::swap(fr.block, then_end);
+			write(var, fr.block, convert(a, to, ast).reg);
+			f().blocks[fr.block].code.push_back(jmp);
+			std::swap(fr.block, then_end);
+
+			seal(end);
+			fr.block = end;
+			result = { read(var, end), to.type, to.is_signed };
+		}
+
+		void on_unary_expression(SyntaxTree::SP &ast) {
+
+			AST::UnaryExpression unary(ast);
+			Value v = value(unary.cast_expression(), constant_type);
+			Kind op = unary.unary_operator().kind();
+			if (op == Kind::op_minus) 
+				v.reg = emit(Op::NEG, v.type, { v.reg });
+			else if (op == Kind::op_tilde) 
+				v.reg = emit(Op::NOT, v.type, { v.reg });
+			else if (op == Kind::op_not) 
+				v = { emit(Op::EQ, Type::I8, { v.reg, zero(v.type) }), Type::I8, false };
+			else if (op != Kind::op_plus)
+				unary.unary_operator().log(ERROR) << unary.unary_operator().id() << " is not supported by the IR (yet)";
+			result = v;
+		}
+
+		void increment(SyntaxTree::SP &target_ast, Kind op) {
+
+			Value v = value(target_ast);
+			Value one = v;
+			one.reg = emit(Op::CONST, v.type, {}, 1);
+			result = assign(target_ast, binary(op, v, one, target_ast));
+		}
+
+		void on_op_plus_plus_lparen_rparen(SyntaxTree::SP &ast) { increment(AST::OpPlusPlusLparenRparen(ast).unary_expression(), Kind::op_plus); }
+		void on_op_minus_minus_lparen_rparen(SyntaxTree::SP &ast) { increment(AST::OpMinusMinusLparenRparen(ast).unary_expression(), Kind::op_minus); }
+
+		void on_assignment_expression(SyntaxTree::SP &ast) {
+
+			static const std::map<Kind, Kind> compound = {
+				{ Kind::op_plus_eq, Kind::op_plus }, { Kind::op_minus_eq, Kind::op_minus }, { Kind::op_star_eq, Kind::op_star },
+				{ Kind::op_slash_eq, Kind::op_slash }, { Kind::op_percent_eq, Kind::op_percent }, { Kind::op_lt_lt_eq, Kind::op_lt_lt },
+				{ Kind::op_gt_gt_eq, Kind::op_gt_gt }, { Kind::op_amp_eq, Kind::op_amp }, { Kind::op_caret_eq, Kind::op_caret },
+				{ Kind::op_pipe_eq, Kind::op_pipe } };
+
+			AST::AssignmentExpression assignment(ast);
+			Value to = target(assignment.unary_expression());
+			Value v = value(assignment.assignment_expression(), &to);
+			auto op = assignment.assignment_operator().kind();
+			if (op != Kind::op_eq)
+				v = binary(compound.at(op), value(assignment.unary_expression()), v, ast);
+			result = assign(assignment.unary_expression(), v);
+		}
+
+		void on_cast_expression(SyntaxTree::SP &ast) {
+
+			AST::CastExpression cast(ast);
+			Value to = scalar(cast.type_name());
+			result = convert(value(cast.cast_expression()), to, ast);
+		}
+
+		void on_kw_sizeof(SyntaxTree::SP &ast) {
+
+			if (ast[0].kind() != Kind::type_name) 
+				ast.log(ERROR) << "sizeof of an expression is not supported by the IR (yet)";
+			const ::Type *type = TypeTable::global().of(ast[0]);
+			if (not type) ast.log(ERROR) << "Type is not supported by the IR (yet)";
+			Value v = constant_type ? *constant_type : Value{ NONE, type->size > 0xFF ? Type::I16 : Type::I8, false };
+			v.reg = emit(Op::CONST, v.type, {}, type->size);
+			result = v;
+		}
+
+		void on_function_call(SyntaxTree::SP &ast) {
+
+			AST::FunctionCall call(ast);
+			Symbol s = resolve(call.postfix_expression());
+			if (s.kind != Symbol::FUNCTION) call.postfix_expression().log(ERROR) << "Only functions can be called";
+
+			auto &signature = signatures[s.index];
+			std::vector<SyntaxTree::SP> none, &args = ast->children.size() > 1 ? call.argument_expression_list()->children : none;
+			if (args.size() != signature.params.size())
+				ast.log(ERROR) << "Wrong number of arguments";
+
+			std::vector<Reg> regs;
+			for (size_t i = 0; i < args.size(); i++)
+				regs.push_back(convert(value(args[i], &signature.params[i]), signature.params[i], args[i]).reg);
+
+			Value v = signature.ret;
+			v.reg = emit(Op::CALL, v.type, regs, s.index);
+			result = v;
+		}
+
+		Value global(uint32_t index) { return { NONE, module.globals[index].type, global_signed[index] }; }
+		std::vector<bool> global_signed;
+
+		Reg zero(Type type) { return emit(Op::CONST, type, {}, 0); }
+
+		// 0 or 1
+		Reg test(Value v) { return emit(Op::NE, Type::I8, { v.reg, zero(v.type) }); }
+
+		// The wider type, unsigned if either is unsigned and they are equally wide.
+		static Value common(Value a, Value b) {
+			if (bits(a.type) == bits(b.type)) return { NONE, a.type, a.is_signed and b.is_signed };
+			return bits(a.type) > bits(b.type) ? a : b;
+		}
+
+		Value binary(Kind kind, Value a, Value b, const SyntaxTree::SP &ast) {
+
+			struct Operator { Op op, signed_op; bool compare, swap; };
+			static const std::map<Kind, Operator> operators = {
+				{ Kind::op_plus, { Op::ADD, Op::ADD, false, false } },
+				{ Kind::op_minus, { Op::SUB, Op::SUB, false, false } },
+				{ Kind::op_star, { Op::MUL, Op::MUL, false, false } },
+				{ Kind::op_slash, { Op::UDIV, Op::SDIV, false, false } },
+				{ Kind::op_percent, { Op::UREM, Op::SREM, false, false } },
+				{ Kind::op_lt_lt, { Op::SHL, Op::SHL, false, false } },
+				{ Kind::op_gt_gt, { Op::LSHR, Op::ASHR, false, false } },
+				{ Kind::op_amp, { Op::AND, Op::AND, false, false } },
+				{ Kind::op_pipe, { Op::OR, Op::OR, false, false } },
+				{ Kind::op_caret, { Op::XOR, Op::XOR, false, false } },
+				{ Kind::op_eq_eq, { Op::EQ, Op::EQ, true, false } },
+				{ Kind::op_not_eq, { Op::NE, Op::NE, true, false } },
+				{ Kind::op_lt, { Op::ULT, Op::SLT, true, false } },
+				{ Kind::op_gt, { Op::ULT, Op::SLT, true, true } },
+				{ Kind::op_lt_eq, { Op::ULE, Op::SLE, true, false } },
+				{ Kind::op_gt_eq, { Op::ULE, Op::SLE, true, true } } };
+
+			auto it = operators.find(kind);
+			if (it == operators.end()) ast.log(ERROR) << "Not a binary operator";
+			auto &o = it->second;
+
+			// Shifts keep the type of what is shifted.
+			Value to = (kind == Kind::op_lt_lt or kind == Kind::op_gt_gt) ? a : common(a, b);
+			a = convert(a, to, ast);
+			b = convert(b, to, ast);
+			if (o.swap) std::swap(a, b);
+
+			Op op = to.is_signed ? o.signed_op : o.op;
+			if (o.compare) return { emit(op, Type::I8, { a.reg, b.reg }), Type::I8, false };
+			return { emit(op, to.type, { a.reg, b.reg }), to.type, to.is_signed };
+		}
+
+		// The type of an assignable expression.
+		Value target(SyntaxTree::SP &ast) {
+
+			if (ast.kind() != Kind::namespaced_identifier)
+				ast.log(ERROR) << "Only variables can be assigned by the IR (yet)";
+			Symbol s = resolve(ast);
+			if (s.kind == Symbol::LOCAL) return fr.vars[s.index];
+			if (s.kind == Symbol::GLOBAL) return global(s.index);
+			ast.log(ERROR) << "Functions can not be assigned"; throw;
+		}
+
+		Value assign(SyntaxTree::SP &ast, Value v) {
+
+			Value to = target(ast);
+			v = convert(v, to, ast);
+			Symbol s = resolve(ast);
+			if (s.kind == Symbol::LOCAL)
+				write(s.index, fr.block, v.reg);
+			else
+				emit(Op::STORE, Type::VOID, { v.reg }, s.index);
+			return v;
+		}
+
+		/////////////////////////////////////////////////////////////////
+		// STATEMENTS
+		void statements(SyntaxTree::SP &ast, bool module_scope) {
+
+			scopes.push_back({ {}, module_scope });
+			declare_functions(ast);
+			for (auto &c : ast->children)
+				dispatch(c);
+			scopes.pop_back();
+		}
+
+		// Functions can be called before they are defined. Prototypes declare functions that other modules define.
+		void declare_functions(SyntaxTree::SP &ast) {
+
+			for (auto &c : ast->children) {
+
+				if (c.kind() == Kind::function_definition_with_implicit_type) {
+					AST::FunctionDefinition definition(AST::FunctionDefinitionWithImplicitType(c).function_definition());
+					declare_function(definition.function_return_type(), definition.function_name(), definition.function_parameter_list_scoped());
+				}
+
+				if (c.kind() == Kind::function_prototype) {
+					AST::FunctionPrototype prototype(c);
+					declare_function(prototype.function_return_type(), prototype.function_name(), prototype.function_parameter_list_scoped());
+				}
+			}
+		}
+
+		void declare_function(SyntaxTree::SP &return_type, SyntaxTree::SP &name, SyntaxTree::SP &params) {
+
+			std::string function_name = AST::FunctionName(name).IDENTIFIER().literal();
+
+			Signature signature;
+			signature.ret = scalar(AST::FunctionReturnType(return_type).type_name());
+			if (params.kind() == Kind::function_parameter_list)
+				for (auto &p : AST::FunctionParameterList(params).items()) {
+					signature.params.push_back(scalar(AST::FunctionParameterDeclaration(p).type_name()));
+					if (signature.params.back().type == Type::VOID) p.log(ERROR) << "Void parameter";
+				}
+
+			Function function;
+			function.name = prefix + function_name;
+			function.ret = signature.ret.type;
+			for (auto &p : signature.params) function.params.push_back(p.type);
+
+			declare(function_name, { Symbol::FUNCTION, uint32_t(module.functions.size()), 0 });
+			module.functions.push_back(function);
+			signatures.push_back(signature);
+		}
+
+		void on_translation_unit(SyntaxTree::SP &ast) { statements(ast, false); }
+		void on_translation_unit_single(SyntaxTree::SP &ast) { statements(ast, false); }
+
+		void on_included_scope(SyntaxTree::SP &ast) {
+
+			declare_functions(ast);
+			for (auto &c : ast->children)
+				dispatch(c);
+		}
+
+		void on_type_declaration(SyntaxTree::SP &ast) {
+
+			AST::TypeDeclaration type_declaration(ast);
+			Value type = scalar(type_declaration.type_name());
+			if (type.type == Type::VOID) ast.log(ERROR) << "Void variable";
+
+			for (auto &item : AST::InitDeclaratorList(type_declaration.init_declarator_list()).items()) {
+				bool initialized = item.kind() == Kind::op_eq;
+				std::string name = initialized ? item[0].literal() : item.literal();
+
+				if (scopes.back().module) {
+					uint32_t index = uint32_t(module.globals.size());
+					module.globals.push_back({ prefix + name, type.type, 0 });
+					global_signed.push_back(type.is_signed);
+					declare(name, { Symbol::GLOBAL, index, 0 });
+					// Constant initializers are part of the global, the others are run by __mc__init.
+					if (initialized and item[1].kind() == Kind::CONSTANT)
+						module.globals[index].init = int64_t(item[1]->first->val & (bits(type.type) == 8 ? 0xFF : 0xFFFF));
+					else if (initialized)
+						emit(Op::STORE, Type::VOID, { convert(value(item[1], &type), type, item[1]).reg }, index);
+				} else {
+					uint32_t var = new_var(type);
+					if (initialized)
+						write(var, fr.block, convert(value(item[1], &type), type, item[1]).reg);
+					declare(name, { Symbol::LOCAL, var, fr.function });
+				}
+			}
+		}
+
+		void on_kw_if(SyntaxTree::SP &ast) {
+
+			AST::If if_ast(ast);
+			bool has_else = if_ast.has_translation_unit_single_0();
+			Value c = value(if_ast.expression());
+			uint32_t then = new_block(), otherwise_block = new_block(), end = has_else ? new_block() : otherwise_block;
+			branch(c, then, otherwise_block);
+			seal(then);
+			fr.block = then;
+			dispatch(if_ast.translation_unit_single());
+			jump(end);
+			if (has_else) {
+				seal(otherwise_block);
+				fr.block = otherwise_block;
+				dispatch(if_ast.translation_unit_single_0());
+				jump(end);
+			}
+			seal(end);
+			fr.block = end;
+		}
+
+		void on_kw_while(SyntaxTree::SP &ast) {
+
+			AST::While while_ast(ast);
+			uint32_t header = new_block(), body = new_block(), exit = new_block();
+			jump(header);
+			fr.block = header;
+			branch(value(while_ast.expression()), body, exit);
+			loop(body, header, exit, while_ast.translation_unit_single());
+			jump(header);
+			seal(header);
+			seal(exit);
+			fr.block = exit;
+		}
+
+		void on_kw_do(SyntaxTree::SP &ast) {
+
+			AST::Do do_ast(ast);
+			uint32_t body = new_block(), condition = new_block(), exit = new_block();
+			jump(body);
+			loop(body, condition, exit, do_ast.translation_unit_single(), false);
+			jump(condition);
+			seal(condition);
+			fr.block = condition;
+			branch(value(do_ast.expression()), body, exit);
+			seal(body);
+			seal(exit);
+			fr.block = exit;
+		}
+
+		void on_kw_for(SyntaxTree::SP &ast) {
+
+			AST::For for_ast(ast);
+			scopes.push_back({ {}, false });
+			dispatch(for_ast.statement());
+			uint32_t header = new_block(), body = new_block(), step = new_block(), exit = new_block();
+			jump(header);
+			fr.block = header;
+			branch(value(for_ast.expression()), body, exit);
+			loop(body, step, exit, for_ast.translation_unit_single());
+			jump(step);
+			seal(step);
+			fr.block = step;
+			value(for_ast.expression_0());
+			jump(header);
+			seal(header);
+			seal(exit);
+			fr.block = exit;
+			scopes.pop_back();
+		}
+
+		// The body of a do loop is only sealed after its condition, which jumps back to it.
+		void loop(uint32_t body, uint32_t continue_target, uint32_t break_target, SyntaxTree::SP &ast, bool sealed = true) {
+
+			if (sealed) seal(body);
+			fr.block = body;
+			fr.loops.emplace_back(continue_target, break_target);
+			dispatch(ast);
+			fr.loops.pop_back();
+		}
+
+		void on_kw_continue(SyntaxTree::SP &ast) {
+
+			if (fr.loops.empty()) ast.log(ERROR) << "continue outside of a loop";
+			jump(fr.loops.back().first);
+		}
+
+		void on_kw_break(SyntaxTree::SP &ast) {
+
+			if (fr.loops.empty()) ast.log(ERROR) << "break outside of a loop";
+			jump(fr.loops.back().second);
+		}
+
+		void on_kw_return(SyntaxTree::SP &ast) {
+
+			AST::Return return_ast(ast);
+			if (return_ast.has_expression() != (fr.ret.type != Type::VOID))
+				ast.log(ERROR) << (fr.ret.type == Type::VOID ? "Value returned from a void function" : "Missing return value");
+			if (return_ast.has_expression())
+				terminate(Op::RET, { convert(value(return_ast.expression(), &fr.ret), fr.ret, ast).reg }, {});
+			else
+				terminate(Op::RET, {}, {});
+		}
+
+		void on_function_definition_with_implicit_type(SyntaxTree::SP &ast) { function(AST::FunctionDefinitionWithImplicitType(ast).function_definition()); }
+
+		// Types declare no values.
+		void on_kw_typedef(SyntaxTree::SP &) {}
+		void on_instance_declaration(SyntaxTree::SP &) {}
+
+		// Declared by declare_functions, they have no body.
+		void on_function_prototype(SyntaxTree::SP &) {}
+
+		void on_kw_namespace(SyntaxTree::SP &ast) {
+
+			AST::Namespace namespace_ast(ast);
+			if (not scopes.back().module) ast.log(ERROR) << "Namespaces can only be declared at the top level";
+			if (not namespace_ast.has_translation_unit()) return;
+
+			auto old_prefix = prefix;
+			std::string name = namespace_ast.IDENTIFIER().literal();
+			prefix += name + "::";
+			scopes.push_back({ {}, true });
+			declare_functions(namespace_ast.translation_unit());
+			for (auto &c : namespace_ast.translation_unit()->children)
+				dispatch(c);
+			auto symbols = std::move(scopes.back().symbols);
+			scopes.pop_back();
+			prefix = old_prefix;
+
+			// Qualified names are visible from the enclosing scope.
+			for (auto &[symbol_name, symbol] : symbols)
+				declare(name + "::" + symbol_name, symbol);
+		}
+
+		void otherwise(SyntaxTree::SP &ast) { ast.log(ERROR) << ast.id() << " is not supported by the IR (yet)"; }
+
+		/////////////////////////////////////////////////////////////////
+		// FUNCTIONS
+		void begin_function(uint32_t function) {
+
+			fr = Frame();
+			fr.function = function;
+			fr.ret = signatures[function].ret;
+			fr.block = new_block();
+			seal(fr.block);
+		}
+
+		void end_function() {
+
+			// Falling off the end of a function that returns a value returns anything.
+			bool unreachable = fr.block != 0 and f().blocks[fr.block].preds.empty();
+			if (fr.ret.type == Type::VOID or unreachable)
+				terminate(Op::RET, {}, {});
+			else
+				terminate(Op::RET, { undef(fr.ret.type) }, {});
+			finalize(f());
+		}
+
+		void function(SyntaxTree::SP &ast) {
+
+			// A body left lazy is not reached by any code (see expand_bodies), so the function is declared but not defined.
+			AST::FunctionDefinition definition(ast);
+			if (definition.function_body()->is_lazy) return;
+
+			Symbol s = resolve_function(AST::FunctionName(definition.function_name()).IDENTIFIER().literal(), ast);
+
+			Frame saved = std::move(fr);
+			begin_function(s.index);
+
+			scopes.push_back({ {}, false });
+			auto &params = definition.function_parameter_list_scoped();
+			if (params.kind() == Kind::function_parameter_list)
+				for (size_t i = 0; i < params->children.size(); i++) {
+					AST::FunctionParameterDeclaration p(params->children[i]);
+					uint32_t var = new_var(signatures[s.index].params[i]);
+					write(var, fr.block, emit(Op::PARAM, fr.vars[var].type, {}, int64_t(i)));
+					if (p.has_IDENTIFIER()) declare(p.IDENTIFIER().literal(), { Symbol::LOCAL, var, fr.function });
+				}
+
+			auto &body = definition.function_body();
+			if (not body->children.empty())
+				statements(body[0], false);
+			scopes.pop_back();
+
+			end_function();
+			fr = std::move(saved);
+		}
+
+		Symbol resolve_function(const std::string &name, const SyntaxTree::SP &ast) {
+
+			auto it = scopes.back().symbols.find(name);
+			if (it == scopes.back().symbols.end() or it->second.kind != Symbol::FUNCTION)
+				ast.log(ERROR) << "Function " << name << " was not declared";
+			return it->second;
+		}
+
+		void build(SyntaxTree::SP &ast) {
+
+			Function init;
+			init.name = "__mc__init";
+			module.functions.push_back(init);
+			signatures.push_back({});
+			begin_function(0);
+
+			statements(ast, true);
+
+			end_function();
+		}
+
+		/////////////////////////////////////////////////////////////////
+		// CLEAN UP
+		// Removes unreachable blocks, phis whose operands are all the same value (or the phi itself), and unused undefs.
+		static void finalize(Function &f) {
+
+			std::vector<uint32_t> renumber(f.blocks.size(), NONE), stack(1, 0);
+			renumber[0] = 0;
+			uint32_t reachable = 1;
+			while (not stack.empty()) {
+				uint32_t b = stack.back();
+				stack.pop_back();
+				for (auto s : f.blocks[b].succs)
+					if (renumber[s] == NONE) { renumber[s] = 0; stack.push_back(s); }
+			}
+			for (size_t b = 1; b < f.blocks.size(); b++)
+				if (renumber[b] != NONE) renumber[b] = reachable++;
+
+			std::vector<Block> blocks(reachable);
+			for (size_t b = 0; b < f.blocks.size(); b++) {
+				if (renumber[b] == NONE) continue;
+				auto &block = f.blocks[b];
+
+				// Phi operands of unreachable predecessors go away with them.
+				std::vector<uint32_t> preds;
+				for (auto &phi : block.phis) phi.n_args = 0;
+				for (size_t i = 0; i < block.preds.size(); i++) {
+					if (renumber[block.preds[i]] == NONE) continue;
+					for (auto &phi : block.phis)
+						f.operands[phi.args + phi.n_args++] = f.operands[phi.args + i];
+					preds.push_back(renumber[block.preds[i]]);
+				}
+				block.preds = preds;
+				for (auto &s : block.succs) s = renumber[s];
+				blocks[renumber[b]] = std::move(block);
+			}
+			f.blocks = std::move(blocks);
+
+			std::vector<Reg> replaced(f.regs.size());
+			for (size_t r = 0; r < replaced.size(); r++) replaced[r] = Reg(r);
+			auto find = [&](Reg r) { while (replaced[r] != r) r = replaced[r] = replaced[replaced[r]]; return r; };
+
+			for (bool changed = true; changed; ) {
+				changed = false;
+				for (auto &block : f.blocks)
+					for (auto &phi : block.phis) {
+						if (phi.dst == NONE) continue;
+						Reg same = NONE;
+						bool trivial = true;
+						for (uint32_t i = 0; i < phi.n_args and trivial; i++) {
+							Reg r = find(f.operands[phi.args + i]);
+							if (r == same or r == phi.dst) continue;
+							trivial = same == NONE;
+							same = r;
+						}
+						if (not trivial) continue;
+						// Only reached from itself: no definition of the variable reaches it.
+						if (same == NONE)
+							f.blocks[0].code.insert(f.blocks[0].code.begin(), Instr{ Op::UNDEF, phi.type, phi.dst, 0, 0, 0 });
+						else
+							replaced[phi.dst] = same;
+						phi.dst = NONE;
+						changed = true;
+					}
+			}
+
+			for (auto &block : f.blocks)
+				block.phis.erase(std::remove_if(block.phis.begin(), block.phis.end(), [](auto &phi) { return phi.dst == NONE; }), block.phis.end());
+			for (auto &r : f.operands) r = find(r);
+
+			// Reads in unreachable blocks leave undefs that nothing uses.
+			std::vector<bool> used(f.regs.size(), false);
+			for (auto &block : f.blocks) {
+				for (auto &phi : block.phis) for (uint32_t k = 0; k < phi.n_args; k++) used[f.args(phi)[k]] = true;
+				for (auto &i : block.code) for (uint32_t k = 0; k < i.n_args; k++) used[f.args(i)[k]] = true;
+			}
+			auto &entry = f.blocks[0].code;
+			entry.erase(std::remove_if(entry.begin(), entry.end(), [&](auto &i) { return i.op == Op::UNDEF and not used[i.dst]; }), entry.end());
+		}
+	};
+
+	Module build(SyntaxTree::SP &ast) {
+
+		Builder builder;
+		builder.build(ast);
+		return std::move(builder.module);
+	}
+
+
+	/////////////////////////////////////////////////////////////////
+	// VERIFIER
+	// Collects the message, and reports it once the statement is over.
+	struct Invalid {
+		const Function &f;
+		std::ostringstream oss;
+		template<typename T> Invalid &operator<<(const T &v) { oss << v; return *this; }
+		~Invalid() noexcept(false) { Log(ERROR) << "IR of " << f.name << " is not valid: " << oss.str(); }
+	};
+
+	static void verify(const Module &module, const Function &f) {
+
+		auto fail = [&]() { return Invalid{ f, {} }; };
+		if (f.blocks.empty()) fail() << "no blocks";
+
+		// Reverse post order, and immediate dominators (Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm").
+		std::vector<uint32_t> order, rpo_index(f.blocks.size(), NONE);
+		{
+			std::vector<bool> visited(f.blocks.size(), false);
+			std::vector<std::pair<uint32_t, size_t>> stack{ { 0, 0 } };
+			visited[0] = true;
+			while (not stack.empty()) {
+				auto &[b, next] = stack.back();
+				if (next < f.blocks[b].succs.size()) {
+					uint32_t s = f.blocks[b].succs[next++];
+					if (s >= f.blocks.size()) fail() << "b" << b << " jumps to a block that does not exist";
+					if (not visited[s]) { visited[s] = true; stack.push_back({ s, 0 }); }
+				} else {
+					order.push_back(b);
+					stack.pop_back();
+				}
+			}
+			std::reverse(order.begin(), order.end());
+			if (order.size() != f.blocks.size()) fail() << "unreachable blocks";
+			for (size_t i = 0; i < order.size(); i++) rpo_index[order[i]] = uint32_t(i);
+		}
+
+		std::vector<uint32_t> idom(f.blocks.size(), NONE);
+		idom[0] = 0;
+		for (bool changed = true; changed; ) {
+			changed = false;
+			for (auto b : order) {
+				if (b == 0) continue;
+				uint32_t new_idom = NONE;
+				for (auto p : f.blocks[b].preds) {
+					if (idom[p] == NONE) continue;
+					if (new_idom == NONE) { new_idom = p; continue; }
+					uint32_t x = p, y = new_idom;
+					while (x != y) {
+						while (rpo_index[x] > rpo_index[y]) x = idom[x];
+						while (rpo_index[y] > rpo_index[x]) y = idom[y];
+					}
+					new_idom = x;
+				}
+				if (new_idom != idom[b]) { idom[b] = new_idom; changed = true; }
+			}
+		}
+		auto dominates = [&](uint32_t a, uint32_t b) {
+			while (b != a and b != 0) b = idom[b];
+			return b == a;
+		};
+
+		// Where each register is defined: block, and position in it (all the phis of a block are at 0).
+		std::vector<std::pair<uint32_t, uint32_t>> defs(f.regs.size(), { NONE, NONE });
+		auto define = [&](const Instr &i, uint32_t b, uint32_t position) {
+			if (i.type == Type::VOID) {
+				if (i.dst != NONE) fail() << "%" << i.dst << " is void";
+				return;
+			}
+			if (i.dst >= f.regs.size()) fail() << name(i.op) << " in b" << b << " does not define a register";
+			if (defs[i.dst].first != NONE) fail() << "%" << i.dst << " is assigned more than once";
+			if (f.regs[i.dst] != i.type) fail() << "%" << i.dst << " is not " << name(i.type);
+			defs[i.dst] = { b, position };
+		};
+		for (uint32_t b = 0; b < f.blocks.size(); b++) {
+			for (auto &phi : f.blocks[b].phis) define(phi, b, 0);
+			for (uint32_t p = 0; p < f.blocks[b].code.size(); p++) define(f.blocks[b].code[p], b, p + 1);
+		}
+
+		// Predecessors are the blocks that have it as a successor.
+		std::vector<std::vector<uint32_t>> preds(f.blocks.size());
+		for (uint32_t b = 0; b < f.blocks.size(); b++)
+			for (auto s : f.blocks[b].succs) preds[s].push_back(b);
+
+		for (uint32_t b = 0; b < f.blocks.size(); b++) {
+			auto &block = f.blocks[b];
+			auto sorted = block.preds;
+			std::sort(sorted.begin(), sorted.end());
+			if (sorted != preds[b]) fail() << "predecessors of b" << b << " do not match the successors";
+
+			auto use = [&](const Instr &i, uint32_t k, uint32_t from, uint32_t position) -> Type {
+				Reg r = f.args(i)[k];
+				if (r >= f.regs.size() or defs[r].first == NONE) fail() << name(i.op) << " in b" << b << " uses an undefined register";
+				bool dominated = defs[r].first == from ? defs[r].second < position : dominates(defs[r].first, from);
+				if (not dominated) fail() << "%" << r << " does not dominate its use by " << name(i.op) << " in b" << b;
+				return f.regs[r];
+			};
+
+			for (auto &phi : block.phis) {
+				if (phi.op != Op::PHI) fail() << name(phi.op) << " among the phis of b" << b;
+				if (phi.n_args != block.preds.size()) fail() << "phi %" << phi.dst << " does not have an operand for each predecessor";
+				for (uint32_t k = 0; k < phi.n_args; k++)
+					if (use(phi, k, block.preds[k], ~0u) != phi.type) fail() << "phi %" << phi.dst << " mixes types";
+			}
+
+			if (block.code.empty() or not is_terminator(block.code.back().op)) fail() << "b" << b << " does not end with a terminator";
+
+			for (uint32_t p = 0; p < block.code.size(); p++) {
+				auto &i = block.code[p];
+				auto arg = [&](uint32_t k) { return use(i, k, b, p + 1); };
+				auto arity = [&](uint32_t n) { if (i.n_args != n) fail() << name(i.op) << " in b" << b << " has " << i.n_args << " operands"; };
+				if (is_terminator(i.op) and p + 1 != block.code.size()) fail() << name(i.op) << " in the middle of b" << b;
+
+				switch (i.op) {
+					case Op::UNDEF: case Op::CONST:
+						arity(0);
+						if (i.type == Type::VOID) fail() << name(i.op) << " is void";
+						break;
+					case Op::PARAM:
+						arity(0);
+						if (b != 0 or uint64_t(i.imm) >= f.params.size() or f.params[i.imm] != i.type) fail() << "wrong param in b" << b;
+						break;
+					case Op::PHI: fail() << "phi after the first instruction of b" << b; break;
+					case Op::LOAD:
+						arity(0);
+						if (uint64_t(i.imm) >= module.globals.size() or module.globals[i.imm].type != i.type) fail() << "wrong load in b" << b;
+						break;
+					case Op::STORE:
+						arity(1);
+						if (uint64_t(i.imm) >= module.globals.size() or module.globals[i.imm].type != arg(0) or i.type != Type::VOID) fail() << "wrong store in b" << b;
+						break;
+					case Op::ADD: case Op::SUB: case Op::MUL: case Op::UDIV: case Op::SDIV: case Op::UREM: case Op::SREM:
+					case Op::SHL: case Op::LSHR: case Op::ASHR: case Op::AND: case Op::OR: case Op::XOR:
+						arity(2);
+						if (arg(0) != i.type or arg(1) != i.type or i.type == Type::VOID) fail() << name(i.op) << " %" << i.dst << " mixes types";
+						break;
+					case Op::NEG: case Op::NOT:
+						arity(1);
+						if (arg(0) != i.type or i.type == Type::VOID) fail() << name(i.op) << " %" << i.dst << " mixes types";
+						break;
+					case Op::EQ: case Op::NE: case Op::ULT: case Op::SLT: case Op::ULE: case Op::SLE:
+						arity(2);
+						if (arg(0) != arg(1) or arg(0) == Type::VOID or i.type != Type::I8) fail() << name(i.op) << " %" << i.dst << " mixes types";
+						break;
+					case Op::ZEXT: case Op::SEXT:
+						arity(1);
+						if (bits(arg(0)) == 0 or bits(arg(0)) >= bits(i.type)) fail() << name(i.op) << " %" << i.dst << " does not widen";
+						break;
+					case Op::TRUNC:
+						arity(1);
+						if (bits(i.type) == 0 or bits(arg(0)) <= bits(i.type)) fail() << name(i.op) << " %" << i.dst << " does not narrow";
+						break;
+					case Op::CALL: {
+						if (uint64_t(i.imm) >= module.functions.size()) fail() << "call to a function that does not exist in b" << b;
+						auto &callee = module.functions[i.imm];
+						arity(uint32_t(callee.params.size()));
+						if (callee.ret != i.type) fail() << "call to " << callee.name << " returns " << name(callee.ret);
+						for (uint32_t k = 0; k < i.n_args; k++)
+							if (arg(k) != callee.params[k]) fail() << "argument " << k << " of " << callee.name << " is not " << name(callee.params[k]);
+						break;
+					}
+					case Op::JMP:
+						arity(0);
+						if (block.succs.size() != 1) fail() << "jmp in b" << b << " needs one successor";
+						break;
+					case Op::BR:
+						arity(1);
+						if (block.succs.size() != 2 or arg(0) == Type::VOID) fail() << "br in b" << b << " needs a condition and two successors";
+						break;
+					case Op::RET:
+						arity(f.ret == Type::VOID ? 0 : 1);
+						if (not block.succs.empty() or (i.n_args and arg(0) != f.ret)) fail() << "ret in b" << b << " does not return " << name(f.ret);
+						break;
+				}
+			}
+		}
+	}
+
+	void verify(const Module &module) {
+
+		for (auto &f : module.functions)
+			if (not f.blocks.empty()) verify(module, f);
+	}
+
+
+	/////////////////////////////////////////////////////////////////
+	// PRINTER
+	void print(std::ostream &os, const Module &module) {
+
+		for (auto &g : module.globals)
+			os << "global " << name(g.type) << " @" << g.name << " = " << g.init << "\n";
+
+		for (auto &f : module.functions) {
+
+			os << (f.blocks.empty() ? "\ndeclare " : "\nfunction ") << name(f.ret) << " @" << f.name << "(";
+			for (size_t i = 0; i < f.params.size(); i++)
+				os << (i ? ", " : "") << name(f.params[i]);
+			if (f.blocks.empty()) {
+				os << ")\n";
+				continue;
+			}
+			os << ") {\n";
+
+			for (size_t b = 0; b < f.blocks.size(); b++) {
+				auto &block = f.blocks[b];
+				os << "b" << b << ":";
+				if (not block.preds.empty()) {
+					os << std::string(b < 10 ? 24 : 23, ' ') << "; preds:";
+					for (auto p : block.preds) os << " b" << p;
+				}
+				os << "\n";
+
+				for (auto &phi : block.phis) {
+					os << "\t%" << phi.dst << " = phi " << name(phi.type);
+					for (uint32_t k = 0; k < phi.n_args; k++)
+						os << (k ? ", " : " ") << "[%" << f.args(phi)[k] << ", b" << block.preds[k] << "]";
+					os << "\n";
+				}
+
+				for (auto &i : block.code) {
+					os << "\t";
+					if (i.dst != NONE) os << "%" << i.dst << " = ";
+					os << name(i.op);
+					// Stores and comparisons show the type of their operands.
+					if (i.op == Op::STORE or (i.op >= Op::EQ and i.op <= Op::SLE))
+						os << " " << name(f.regs[f.args(i)[0]]);
+					else if (i.type != Type::VOID)
+						os << " " << name(i.type);
+
+					const char *separator = " ";
+					auto operand = [&]() -> std::ostream & { os << separator; separator = ", "; return os; };
+					if (i.op == Op::CONST or i.op == Op::PARAM) operand() << i.imm;
+					if (i.op == Op::LOAD or i.op == Op::STORE) operand() << "@" << module.globals[i.imm].name;
+					if (i.op == Op::CALL) operand() << "@" << module.functions[i.imm].name;
+					for (uint32_t k = 0; k < i.n_args; k++) operand() << "%" << f.args(i)[k];
+					for (auto s : block.succs)
+						if (i.op == Op::JMP or i.op == Op::BR) operand() << "b" << s;
+					os << "\n";
+				}
+			}
+			os << "}\n";
+		}
+	}
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include <ast.h>
+
+////////////////////////////////////////////////////////////////////////
+// INTERMEDIATE REPRESENTATION
+// Typed three-address code in SSA form, built from the tree after the Symbols and Types passes.
+// Functions are flat arrays of basic blocks, blocks are flat arrays of fixed size instructions, and every value is a virtual
+// register that is assigned exactly once. Operations are explicitly 8 or 16 bits wide; signedness is a property of the
+// operation (sdiv, ult, sext...), not of the register. Module level variables live in memory and are accessed with load and store.
+namespace IR {
+
+	enum class Type : uint8_t { VOID, I8, I16 };
+
+	enum class Op : uint8_t {
+		UNDEF, CONST, PARAM, PHI,                               // imm: value of CONST, index of PARAM
+		LOAD, STORE,                                            // imm: global
+		ADD, SUB, MUL, UDIV, SDIV, UREM, SREM, SHL, LSHR, ASHR, AND, OR, XOR,
+		NEG, NOT,
+		EQ, NE, ULT, SLT, ULE, SLE,                             // 0 or 1, in 8 bits
+		ZEXT, SEXT, TRUNC,
+		CALL,                                                   // imm: function
+		JMP, BR, RET,                                           // terminators, their targets are the successors of the block
+	};
+
+	const char *name(Type type);
+	const char *name(Op op);
+	inline bool is_terminator(Op op) { return op == Op::JMP or op == Op::BR or op == Op::RET; }
+
+	using Reg = uint32_t;
+	constexpr Reg NONE = ~Reg(0);
+
+	// Operands are a span of Function::operands. The operands of a phi follow the order of the predecessors of its block.
+	struct Instr {
+		Op op;
+		Type type; // of the result, VOID if there is none
+		Reg dst = NONE;
+		uint32_t args = 0, n_args = 0;
+		int64_t imm = 0;
+	};
+
+	struct Block {
+		std::vector<Instr> phis, code;   // the last instruction of code is its only terminator
+		std::vector<uint32_t> preds, succs; // BR goes to succs[0] if its operand is not 0, else to succs[1]
+	};
+
+	struct Function {
+		std::string name;
+		Type ret = Type::VOID;
+		std::vector<Type> params;
+
+		std::vector<Block> blocks; // blocks[0] is the entry. None for the functions of other modules, see function_prototype
+		std::vector<Type> regs;    // type of each register
+		std::vector<Reg> operands;
+
+		const Reg *args(const Instr &i) const { return operands.data() + i.args; }
+	};
+
+	struct Global {
+		std::string name; // qualified with its namespaces, e.g. N::x
+		Type type;
+		int64_t init = 0;
+	};
+
+	// Top level statements, and initializers of globals that are not constants, go to a function named __mc__init.
+	struct Module {
+		std::vector<Global> globals;
+		std::vector<Function> functions;
+	};
+
+	// Reports constructs that can not be lowered yet as errors.
+	Module build(SyntaxTree::SP &ast);
+
+	// Checks the SSA form and the types, reports the first problem as an error.
+	void verify(const Module &module);
+
+	void print(std::ostream &os, const Module &module);
+}
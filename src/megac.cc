@@ -1,9 +1,56 @@
 #include "parser.h"
 #include "file.h"
 #include "generator.h"
+#include "pass_manager.h"
 
 #include <boost/program_options.hpp>
 
+#include <algorithm>
+#include <chrono>
+
+
+// Parses source_file, then edited_file incrementally from it, and checks the result against a full parse of edited_file.
+// The edit, which an editor would know, is what lies between the bytes the two files start and end with.
+static bool check_reparse(const std::string &source_file_name, const std::string &edited_file_name) {
+
+	SourceFile &source_file = SourceFile::Manager::get(source_file_name);
+	SourceFile &edited_file = SourceFile::Manager::get(edited_file_name);
+	SyntaxTree::SP source_syntax_tree = std::make_shared<SyntaxTree>( source_file );
+
+	const std::string &before = *source_file.source, &after = *edited_file.source;
+	size_t common_first = std::mismatch(before.begin(), before.end(), after.begin(), after.end()).first - before.begin();
+	size_t common_last = std::mismatch(before.rbegin(), before.rend() - common_first, after.rbegin(), after.rend() - common_first).first - before.rbegin();
+
+	auto start = std::chrono::steady_clock::now();
+	SyntaxTree::SP incremental = SyntaxTree::reparse(source_syntax_tree, source_file, edited_file, common_first, before.size() - common_last, after.size() - common_last);
+	auto reparsed = std::chrono::steady_clock::now();
+
+	// A copy of the edited file, so the full parse tokenizes it as well.
+	SourceFile &full_file = SourceFile::Manager::get(edited_file_name + " (full parse)", after);
+	SyntaxTree::SP full = std::make_shared<SyntaxTree>( full_file );
+	auto parsed = std::chrono::steady_clock::now();
+
+	auto ms = [](auto d) { return std::chrono::duration<double, std::milli>(d).count(); };
+	std::cout << "incremental reparse: " << ms(reparsed - start) << " ms, full parse: " << ms(parsed - reparsed) << " ms" << std::endl;
+
+	if (incremental.to_string() != full.to_string()) {
+		std::cout << "incremental reparse differs from a full parse of " << edited_file_name << std::endl;
+		return false;
+	}
+
+	auto &tokens = *edited_file.tokens, &full_tokens = *full_file.tokens;
+	auto same = [](const Token &a, const Token &b) { 
+		auto position = [](const NormalizedSourcePtr &p) { auto q = p.position(); return std::make_tuple(q.offset, q.line_offset, q.line, q.c); };
+		return a.type == b.type and a.literal == b.literal and a.val == b.val and a.has_space == b.has_space and a.start_of_line == b.start_of_line and 
+			position(a.begin_ptr) == position(b.begin_ptr) and position(a.end_ptr) == position(b.end_ptr);
+	};
+	if (not std::equal(tokens.begin(), tokens.end(), full_tokens.begin(), full_tokens.end(), same) or *edited_file.matching_delimiters != *full_file.matching_delimiters) {
+		std::cout << "incremental retokenization differs from tokenizing " << edited_file_name << std::endl;
+		return false;
+	}
+	return true;
+}
+
 
 int main(int argc, char *argv[]) {
 		
@@ -14,6 +61,23 @@ int main(int argc, char *argv[]) {
 	pod.add_options() 
 		("help,h", "produce this help message")
 		("log,l", po::value<int>()->default_value(0), "set log level")
+		("parse-threads,j", po::value<size_t>()->default_value(1), "parse large files on this many threads (0: all cores)")
+		("include-threads", po::value<size_t>()->default_value(1), "parse included files ahead of the preprocessor on this many threads (0: disable)")
+		("parse-max-calls", po::value<uint64_t>()->default_value(0), "stop parsing a file after this many parse calls (0: unlimited)")
+		("parse-max-candidates", po::value<uint64_t>()->default_value(0), "stop parsing a file after this many candidate trees (0: unlimited)")
+		("lazy-function-bodies", "parse function bodies only when they are accessed")
+		("check-lazy-bodies", "with --lazy-function-bodies, also parse the bodies that no code reaches, to report their syntax errors")
+		("analyze-grammar", "report duplicate recipes, unreachable symbols, left recursion, FIRST/FIRST conflicts and branching factors")
+		("parse-stats", "print parser statistics per symbol and recipe")
+		("parse-stats-json", "print parser statistics as json")
+		("dump-ast-after", po::value<std::vector<std::string>>(), "print the syntax tree after a pass: preprocessor, hash_consing, symbols, types, optimizer or all (repeatable)")
+		("emit-ir", "lower the syntax tree to SSA form and print it")
+		("pass-times", "print the time spent in each compiler pass")
+		("no-pass-fusion", "run every compiler pass in its own walk of the tree")
+		("save-ast", po::value<std::string>(), "save the syntax tree after preprocessing to this binary file")
+		("emit-interface", po::value<std::string>(), "save the interface of the source file to this file (<module>.mci), for the files that import it")
+		("load-ast", po::value<std::string>(), "compile a syntax tree saved with --save-ast instead of a source file")
+		("reparse-check", po::value<std::string>(), "parse the source file, then this edited copy of it incrementally, and check the result against a full parse")
 		("source_file,i", po::value<std::string>(), "Input source files");
 
 	po::positional_options_description p;
@@ -23,14 +87,41 @@ int main(int argc, char *argv[]) {
 	po::store( po::command_line_parser( argc, argv).options(pod).positional(p).run(), pom);
 	po::notify(pom);
 
-	if (pom.count("help") or pom.count("source_file") == 0) {
+	if (pom.count("analyze-grammar")) {
+		Grammar grammar;
+		return grammar.analyze(std::cout) ? 1 : 0;
+	}
+
+	if (pom.count("help") or (pom.count("source_file") == 0 and pom.count("load-ast") == 0)) {
 		std::cout << "Usage:" << std::endl <<  pod << "\n";
 		return 0;
 	}
 	
 	Log::report_level() = static_cast<LogLevel>(pom["log"].as<int>());
 
-	std::string source_file_name = pom["source_file"].as<std::string>();
+	ParseStats::enabled() = pom.count("parse-stats") or pom.count("parse-stats-json");
+	ParseOptions::threads() = pom["parse-threads"].as<size_t>();
+	ParseOptions::include_threads() = pom["include-threads"].as<size_t>();
+	ParseOptions::lazy_function_bodies() = pom.count("lazy-function-bodies");
+	ParseOptions::check_lazy_bodies() = pom.count("check-lazy-bodies");
+	ParseOptions::max_calls() = pom["parse-max-calls"].as<uint64_t>();
+	ParseOptions::max_candidates() = pom["parse-max-candidates"].as<uint64_t>();
+	if (ParseOptions::threads() == 0) ParseOptions::threads() = std::max(1u, std::thread::hardware_concurrency());
+
+	if (pom.count("dump-ast-after")) 
+		for (auto &pass : pom["dump-ast-after"].as<std::vector<std::string>>()) 
+			GeneratorOptions::dump_ast_after().insert(pass);
+	GeneratorOptions::pass_times() = pom.count("pass-times");
+	GeneratorOptions::emit_ir() = pom.count("emit-ir");
+	PassManager::fuse() = not pom.count("no-pass-fusion");
+	if (pom.count("save-ast")) GeneratorOptions::save_ast() = pom["save-ast"].as<std::string>();
+	if (pom.count("emit-interface")) GeneratorOptions::emit_interface() = pom["emit-interface"].as<std::string>();
+	if (pom.count("load-ast")) GeneratorOptions::load_ast() = pom["load-ast"].as<std::string>();
+
+	std::string source_file_name = pom.count("source_file") ? pom["source_file"].as<std::string>() : "";
+
+	if (pom.count("reparse-check")) 
+		return check_reparse(source_file_name, pom["reparse-check"].as<std::string>()) ? 0 : 1;
 
 //	SourceFile &source_file = SourceFile::Manager::get(source_file_name);
 
@@ -38,7 +129,13 @@ int main(int argc, char *argv[]) {
 	
 //	std::cout << main_syntax_tree->to_string();
 	
-	generate_code( source_file_name );
+	try {
+		generate_code( source_file_name );
+	} catch (...) {
+		if (ParseStats::enabled()) ParseStats::global().print(std::cerr, pom.count("parse-stats-json"));
+		throw;
+	}
+	if (ParseStats::enabled()) ParseStats::global().print(std::cerr, pom.count("parse-stats-json"));
 	
 	
 	
@@ -1,25 +1,203 @@
 #include "parser.h"
 #include "grammar.h"
+#include "grammar_kinds.h"
 #include "log.h"
 
+#include <chrono>
+#include <algorithm>
+
 static Grammar grammar;
 
-std::vector<SyntaxTree::SP> parse(SyntaxTree::TI token_it, SyntaxTree::TI last_token, Grammar::Symbol::Component target, ParseDebug &debug, std::vector<std::string> parent_targets_without_consuming_tokens, SyntaxTree::SP parent) {
-
-	// This filters out non-trivially front-recursive recipes. I haven't slept in a week while trying and failing to find a general solution for this problem. Randomly, some kind of programming deity just put me this idea on my mind. It seems to work. I have no idea why.
-	if (parent_targets_without_consuming_tokens.size()>2) {
-		size_t N = parent_targets_without_consuming_tokens.size();
-		bool parent_is_on_the_list = false;
-		for (size_t n = 0; n < N-2; n++)
-			if (parent_targets_without_consuming_tokens[n] == parent_targets_without_consuming_tokens[N-2])
-				parent_is_on_the_list = true;
-				
-		if (parent_is_on_the_list) {
-			for (size_t n = 0; n < N-1; n++)
-				if (parent_targets_without_consuming_tokens[n] == parent_targets_without_consuming_tokens[N-1])
-					return std::vector<SyntaxTree::SP>();
+// grammar_kinds.h is generated from grammar.y at build time, and must number the node kinds as the loaded grammar does.
+[[maybe_unused]] static const bool kinds_match = [] {
+	bool match = (grammar.kind_names.size() == kind_count);
+	for (size_t i = 0; match and i < kind_count; i++) 
+		match = (grammar.kind_names[i] == kind_names[i]);
+	if (not match) Log(ERROR) << "Node kinds in grammar_kinds.h do not match grammar.y, rebuild.\n";
+	return match;
+}();
+
+void ParseStats::merge(const ParseStats &other) {
+
+	static std::mutex mtx;
+	std::lock_guard<std::mutex> lock(mtx);
+
+	auto add = [](Entry &a, const Entry &b) {
+		a.calls += b.calls;
+		a.candidates += b.candidates;
+		a.discarded += b.discarded;
+		a.seconds += b.seconds;
+		a.max_depth = std::max(a.max_depth, b.max_depth);
+	};
+
+	for (auto &[name, o] : other.symbols) {
+		auto &e = symbols[name];
+		add(e, o);
+		if (e.recipes.size() < o.recipes.size()) e.recipes.resize(o.recipes.size());
+		for (size_t i = 0; i < o.recipes.size(); i++)
+			add(e.recipes[i], o.recipes[i]);
+	}
+}
+
+void ParseStats::print(std::ostream &os, bool json) const {
+
+	std::vector<std::pair<std::string, const SymbolEntry *>> sorted;
+	for (auto &[name, e] : symbols) 
+		sorted.emplace_back(name, &e);
+	std::sort(sorted.begin(), sorted.end(), [](auto &a, auto &b) { return a.second->seconds > b.second->seconds; });
+
+	auto recipe_to_string = [](const std::string &name, size_t i) {
+		std::string ret;
+		auto it = grammar.symbols.find(name);
+		if (it == grammar.symbols.end() or i >= it->second.recipes.size()) return ret;
+		for (auto &c : it->second.recipes[i]) 
+			ret += (ret.empty() ? "" : " ") + (c.is_token() ? "'" + c.id() + "'" : c.id());
+		return ret;
+	};
+
+	if (json) {
+		auto entry = [&](const Entry &e) {
+			os << "\"calls\": " << e.calls << ", \"candidates\": " << e.candidates << ", \"discarded\": " << e.discarded 
+			   << ", \"ms\": " << e.seconds * 1e3 << ", \"max_depth\": " << e.max_depth;
+		};
+		os << "[\n";
+		for (auto &[name, e] : sorted) {
+			os << "  { \"symbol\": \"" << name << "\", ";
+			entry(*e);
+			os << ", \"recipes\": [";
+			for (size_t i = 0; i < e->recipes.size(); i++) {
+				os << (i ? ", " : "") << "{ \"recipe\": \"" << recipe_to_string(name, i) << "\", ";
+				entry(e->recipes[i]);
+				os << " }";
+			}
+			os << "] }" << (&name == &sorted.back().first ? "" : ",") << "\n";
 		}
+		os << "]\n";
+		return;
+	}
+
+	auto row = [&](const std::string &name, const Entry &e) {
+		os << std::setw(12) << e.calls << std::setw(12) << e.candidates << std::setw(12) << e.discarded 
+		   << std::setw(12) << std::fixed << std::setprecision(3) << e.seconds * 1e3 << std::setw(8) << e.max_depth << "  " << name << "\n";
+	};
+
+	os << std::setw(12) << "calls" << std::setw(12) << "candidates" << std::setw(12) << "discarded" << std::setw(12) << "incl. ms" << std::setw(8) << "depth" << "  symbol\n";
+	for (auto &[name, e] : sorted) {
+		row(name, *e);
+		for (size_t i = 0; i < e->recipes.size(); i++) 
+			if (e->recipes[i].calls)
+				row("  : " + recipe_to_string(name, i), e->recipes[i]);
 	}
+}
+
+template<bool Stats>
+static std::vector<SyntaxTree::SP> parse_int(SyntaxTree::TI token_it, SyntaxTree::TI last_token, const Grammar::Symbol::Component &target, ParseDebug &debug, SyntaxTree::SP parent);
+
+std::string ParseBudgetExceeded::describe() const {
+
+	std::ostringstream oss;
+	oss << "Parse budget exceeded after " << calls << " parse calls and " << candidates << " candidates";
+	if (located) 
+		oss << ". Candidates exploded in " << symbol << " (" << first->begin_ptr.get_file().path << ") from line " << first->begin_ptr.get_line() << " to line " << last->begin_ptr.get_line() << ":\n" << first->show_source();
+	return oss.str();
+}
+
+// Whether a parse is measured is chosen once, by parse(): all the calls it makes are instantiated with or without the statistics.
+template<bool Stats>
+static std::vector<SyntaxTree::SP> parse_measured(SyntaxTree::TI token_it, SyntaxTree::TI last_token, const Grammar::Symbol::Component &target, ParseDebug &debug, SyntaxTree::SP parent) {
+
+	if constexpr (not Stats) 
+		return parse_int<false>(token_it, last_token, target, debug, std::move(parent));
+
+	auto &entry = debug.stats->symbols[target.is_token() ? "'" + target.id() + "'" : target.id()];
+	entry.calls++;
+	entry.max_depth = std::max(entry.max_depth, ++debug.depth);
+	
+	auto start = std::chrono::steady_clock::now();
+	auto ret = parse_int<true>(token_it, last_token, target, debug, std::move(parent));
+	entry.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	entry.candidates += ret.size();
+	debug.depth--;
+	
+	return ret;
+}
+
+template<bool Stats>
+static std::vector<SyntaxTree::SP> parse_call(SyntaxTree::TI token_it, SyntaxTree::TI last_token, const Grammar::Symbol::Component &target, ParseDebug &debug, SyntaxTree::SP parent) {
+
+	if (not debug.budget) 
+		return parse_measured<Stats>(token_it, last_token, target, debug, std::move(parent));
+
+	auto &budget = *debug.budget;
+	uint64_t calls_before = budget.calls++, candidates_before = budget.candidates;
+	if (budget.exhausted()) 
+		throw ParseBudgetExceeded();
+
+	auto outer_furthest = debug.furthest;
+	debug.furthest = token_it;
+	try {
+		auto ret = parse_measured<Stats>(token_it, last_token, target, debug, std::move(parent));
+		budget.candidates += ret.size();
+		debug.furthest = std::max(debug.furthest, outer_furthest);
+		return ret;
+
+	} catch (ParseBudgetExceeded &e) {
+
+		// The explosion is the innermost invocation that accounts for at least half of the exhausted budget.
+		e.calls = budget.calls;
+		e.candidates = budget.candidates;
+		bool by_calls = ParseOptions::max_calls() and e.calls > ParseOptions::max_calls();
+		uint64_t share = (by_calls ? e.calls - calls_before : e.candidates - candidates_before);
+		if (not e.located and token_it != last_token and 2 * share >= (by_calls ? e.calls : e.candidates)) {
+			e.located = true;
+			e.symbol = target.id();
+			e.first = token_it;
+			e.last = (debug.furthest == last_token ? last_token - 1 : debug.furthest);
+		}
+		debug.furthest = std::max(debug.furthest, outer_furthest);
+		throw;
+	}
+}
+
+std::vector<SyntaxTree::SP> parse(SyntaxTree::TI token_it, SyntaxTree::TI last_token, const Grammar::Symbol::Component &target, ParseDebug &debug, SyntaxTree::SP parent) {
+
+	if (debug.stats) 
+		return parse_call<true>(token_it, last_token, target, debug, std::move(parent));
+	return parse_call<false>(token_it, last_token, target, debug, std::move(parent));
+}
+
+// True if ast was parsed on top of the seed of a left recursion: the seed, or what a %weak seed is reduced to, is one of its leftmost 
+// descendants. These all start where the seed does, so only the few levels that span at least as many tokens are walked.
+static bool consumes_seed(const SyntaxTree::SP &ast, const SyntaxTree::SP &seed) {
+
+	const SyntaxTree *reduced = seed->children.size() == 1 ? seed->children.front().get() : nullptr;
+	for (const SyntaxTree *node = ast.get(); node and node->last >= seed->last; ) {
+		if (node == seed.get() or node == reduced) return true;
+		node = node->children.empty() ? nullptr : node->children.front().get();
+	}
+	return false;
+}
+
+// A %weak symbol with no children is empty, and one with a single child is replaced by that child.
+static void reduce_weak(SyntaxTree::SP &ast, const Grammar::Symbol::Component &target) {
+
+	if (ast->component.id() != target.id()) 
+		return;
+
+	if (ast->children.empty()) {
+		ast->is_empty = true;
+	}
+	if (ast->children.size() == 1) {
+		auto e = ast->last;
+		auto p = ast->parent;
+		ast = ast->children.front();
+		ast->last = e;
+		ast->parent = p;
+	}
+}
+
+template<bool Stats>
+static std::vector<SyntaxTree::SP> parse_int(SyntaxTree::TI token_it, SyntaxTree::TI last_token, const Grammar::Symbol::Component &target, ParseDebug &debug, SyntaxTree::SP parent) {
 
 	// tackle leaf nodes: which can be a keyword, an identifier, a numeric constant, or a string literal.
 	{
@@ -42,7 +220,7 @@ std::vector<SyntaxTree::SP> parse(SyntaxTree::TI token_it, SyntaxTree::TI last_t
 				ret->is_empty = true;
 
 			if (target.must_keep) {
-				ret->component = Grammar::Symbol::Component::Symbol( token_it->literal );
+				ret->component = (target.is_token() ? target.as_symbol() : Grammar::Symbol::Component::Symbol( token_it->literal ));
 			}
 
 			return std::vector<SyntaxTree::SP>(1, ret);
@@ -65,152 +243,188 @@ std::vector<SyntaxTree::SP> parse(SyntaxTree::TI token_it, SyntaxTree::TI last_t
 		if ( target.is_token() ) 
 			return expect( (token_it->type != Token::STRING_LITERAL) and (token_it->literal == target.id()) );
 
+		// In lazy mode a function_body is a leaf that spans its braces, see SyntaxTree::SP::expand.
+		if ( ParseOptions::lazy_function_bodies() and target.id() == "function_body" ) {
+			auto closer = SyntaxTree::matching_delimiter(token_it);
+			auto ret = expect( (token_it->type == Token::PUNCTUATOR) and (token_it->literal == "{") and (closer != token_it) );
+			for (auto &body : ret) {
+				body->last = closer + 1;
+				body->is_lazy = true;
+			}
+			return ret;
+		}
+
 	} 
 
 	
-	// for each target symbol, there may be several recipes possible.
-	std::vector<SyntaxTree::SP> all_ast;
+	const Grammar::Symbol &symbol = grammar.get(target);
+	auto &recipes = symbol.recipes;
 
-	// register our current target.
-	parent_targets_without_consuming_tokens.push_back(target.id());
+	// Left recursion is handled by growing a seed (Warth et al.). A call that reenters a symbol at the same token,
+	// without having consumed anything, gets the seed currently being grown, or nothing while there is no seed yet.
+	// Calls only move forward through the tokens, so the innermost invocation of a symbol is the only one that can match.
+	if (debug.left_recursion.size() < grammar.symbol_list.size()) 
+		debug.left_recursion.resize(grammar.symbol_list.size());
 
-	// for each symbol, we tackle first the recipes that aren't front-recursive
-	for (auto &recipe : grammar.symbols[target.id()].recipes) {
+	if (debug.left_recursion[symbol.index].active and debug.left_recursion[symbol.index].position == token_it) {
 
-		// skip pure front-recursive recipes.
-		{
-			bool is_front_recursive_recipe = recipe.front().is_symbol() and (recipe.front().id() == target.id());
-			if (is_front_recursive_recipe) continue;
-		}
+		SyntaxTree::SP seed = debug.left_recursion[symbol.index].seed;
+		if (not seed) 
+			return std::vector<SyntaxTree::SP>();
+
+		if (symbol.is_weak) 
+			reduce_weak(seed, target);
+		return std::vector<SyntaxTree::SP>(1, seed);
+	}
+
+	auto outer_invocation = debug.left_recursion[symbol.index];
+	debug.left_recursion[symbol.index] = { true, token_it, SyntaxTree::SP() };
 
-		std::vector<SyntaxTree::SP> ast;
-		ast.push_back(std::make_shared<SyntaxTree>(token_it, target, parent));
-		ast.back()->last = token_it;
+	// per recipe statistics, only while --parse-stats is enabled.
+	ParseStats::Entry *recipe_stats = nullptr;
+	if constexpr (Stats) {
+		auto &e = debug.stats->symbols[target.id()];
+		e.recipes.resize(recipes.size());
+		recipe_stats = e.recipes.data();
+	}
 
-		for (auto component : recipe) {
+	// extends each tentative ast with every way to parse the next component of the recipe.
+	auto parse_component = [&](const std::vector<SyntaxTree::SP> &ast, const Grammar::Symbol::Component &component, ParseStats::Entry *stats) {
+
+		std::vector<SyntaxTree::SP> tentative_ast;
+		
+		for (auto &a : ast) {
 
-			std::vector<SyntaxTree::SP> tentative_ast;
+			size_t n_tentative = tentative_ast.size();
+			for (auto &c : parse_call<Stats>(a->last, last_token, component, debug, SyntaxTree::SP())) {
 			
-			for (auto &a : ast) {
-
-				
-				bool is_first = ( a->last == token_it );
-				
-				auto &&t = (is_first?parent_targets_without_consuming_tokens:std::vector<std::string>()); 
-
-				for (auto &c : parse(a->last, last_token, component, debug, t)) {
-				
-					auto a2 = std::make_shared<SyntaxTree>(*a);
-					a2->last = c->last;
-					for (auto &a2c : a2->children)
-						a2c->parent = a2;
-
-					if (component.force_root) {
-						a2->component = Grammar::Symbol::Component::Symbol( c->component.id() );
-						for (auto &c2 : c->children) {
-							c2->parent = a2;
-							a2->children.push_back( c2 ) ;
-						}
-					} else if (c->is_empty == false) {
-						c -> parent = a2;
-						a2->children.push_back( c );
+				auto a2 = std::make_shared<SyntaxTree>(*a);
+				a2->last = c->last;
+				for (auto &a2c : a2->children)
+					a2c->parent = a2;
+
+				if (component.force_root) {
+					a2->component = c->component.as_symbol();
+					for (auto &c2 : c->children) {
+						c2->parent = a2;
+						a2->children.push_back( c2 ) ;
 					}
-
-					tentative_ast.push_back( a2 );
+				} else if (c->is_empty == false) {
+					c -> parent = a2;
+					a2->children.push_back( c );
 				}
+
+				tentative_ast.push_back( a2 );
 			}
+			if constexpr (Stats) 
+				if (n_tentative == tentative_ast.size()) stats->discarded++;
+		}
+		return tentative_ast;
+	};
+
+	// a new, empty tentative ast starting at token it.
+	auto start_at = [&](SyntaxTree::TI it) {
+		SyntaxTree::SP ast = std::make_shared<SyntaxTree>(it, target, parent);
+		ast->last = it;
+		return std::vector<SyntaxTree::SP>(1, ast);
+	};
+
+	// parses the components of a recipe, starting from first_component, after the given tentative ast.
+	auto parse_recipe = [&](const std::vector<Grammar::Symbol::Component> &recipe, std::vector<SyntaxTree::SP> ast, size_t first_component) {
+
+		ParseStats::Entry *stats = nullptr;
+		std::chrono::steady_clock::time_point start;
+		if constexpr (Stats) {
+			stats = &recipe_stats[&recipe - &recipes.front()];
+			stats->calls++;
+			stats->max_depth = std::max(stats->max_depth, debug.depth);
+			start = std::chrono::steady_clock::now();
+		}
+
+		for (size_t i = first_component; i < recipe.size(); i++) 
+			ast = parse_component(ast, recipe[i], stats);
 
-			ast = tentative_ast;
+		if constexpr (Stats) {
+			stats->candidates += ast.size();
+			stats->seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 		}
-		
-		for (auto &a : ast)
-			all_ast.push_back(a);
-	}
+		return ast;
+	};
 
-	// then, for each tentative ast, we tacke the recipes that are front-recursive
-	{
-		std::vector<SyntaxTree::SP> all_expanded_ast;
-		
-		while (not all_ast.empty()) {
+	// for each target symbol, there may be several recipes possible.
+	std::vector<SyntaxTree::SP> all_ast;
 
-			SyntaxTree::SP ast_to_expand = all_ast.back();
-			all_ast.pop_back();
+	// for each symbol, we tackle first the recipes that aren't directly front-recursive. 
+	// Indirectly front-recursive ones can only succeed here through alternatives that do not come back to this symbol.
+	for (size_t r = 0; r < recipes.size(); r++) {
 
-			all_expanded_ast.push_back(ast_to_expand);
-			
-			for (auto &recipe : grammar.symbols[target.id()].recipes) {
-								
-				// skip non front-recursive recipes.
-				{
-					bool is_front_recursive_recipe = recipe.front().is_symbol() and (recipe.front().id() == target.id());
-					if (not is_front_recursive_recipe) continue;
-				}
-				
-				std::vector<SyntaxTree::SP> ast;
-				ast.push_back(std::make_shared<SyntaxTree>(token_it, target, parent));
-				ast.back()->last = token_it;
-				
-				for (auto component : recipe) {
-					
-					std::vector<SyntaxTree::SP> tentative_ast;
-
-					for (auto &a : ast) {
-						
-						if (a->last == token_it) {
-						
-							tentative_ast.push_back(std::make_shared<SyntaxTree>( *ast_to_expand ) );
-							continue;
-						}
-
-						for (auto &c : parse(a->last, last_token, component, debug)) {
-						
-							auto a2 = std::make_shared<SyntaxTree>(*a);
-							a2->last = c->last;
-							for (auto &a2c : a2->children)
-								a2c->parent = a2;
-
-							if (component.force_root) {
-								a2->component = Grammar::Symbol::Component::Symbol( c->component.id() );
-								for (auto &c2 : c->children) {
-									c2->parent = a2;
-									a2->children.push_back( c2 ) ;
-								}
-							} else if (c->is_empty == false) {
-								c -> parent = a2;
-								a2->children.push_back( c );
-							}
-							tentative_ast.push_back( a2 );
-						}
-					}
-					
-					ast = tentative_ast;
-				}
-				
-				for (auto &a : ast)
-					all_ast.push_back(a);
-			}			
-		}
-		
-		all_ast = all_expanded_ast;
+		if (symbol.left_recursion[r] == Grammar::Symbol::DIRECT) continue;
+
+		for (auto &a : parse_recipe(recipes[r], start_at(token_it), 0))
+			all_ast.push_back(a);
 	}
 
-	if (grammar.symbols[target.id()].is_weak) {
-		for (auto &ast : all_ast) {
-			if (ast->component.id() != target.id()) {
-				continue;
-			}
-			if (ast->children.empty()) {
-				ast->is_empty = true;
+	// Each tentative ast is used as the seed of the front-recursive recipes, and grown for as long as it gets longer. 
+	// Growth is greedy: only the seeds that do not grow any further are returned, so a chain of n operators is parsed with n growth 
+	// steps, and not returned as its n prefixes for the caller to discard.
+	std::vector<SyntaxTree::SP> all_expanded_ast;
+	
+	while (not all_ast.empty()) {
+
+		SyntaxTree::SP seed = all_ast.back();
+		all_ast.pop_back();
+
+		// A longer parse of an indirect recipe only grows the seed if it was built on it.
+		std::vector<SyntaxTree::SP> grown;
+		if (not symbol.is_list) {
+			for (size_t r = 0; r < recipes.size(); r++) {
+				if (symbol.left_recursion[r] != Grammar::Symbol::INDIRECT) continue;
+
+				auto &growth = debug.left_recursion[symbol.index];
+				growth.seed = seed;
+				for (auto &a : parse_recipe(recipes[r], start_at(token_it), 0)) 
+					if (a->last > seed->last and consumes_seed(a, seed)) 
+						grown.push_back(a);
+				growth.seed = SyntaxTree::SP();
 			}
-			if (ast->children.size() == 1) {
-				auto e = ast->last;
-				auto p = ast->parent;
-				ast = ast->children.front();
-				ast->last = e;
-				ast->parent = p;
+		}
+
+		// Direct recipes are parsed after the seed, and their tails appended to it. Operator chains and %list symbols are flat, 
+		// so copying the seed on every step would be quadratic in its length: the last tail takes the seed itself, unless 
+		// an indirect recipe has grown a candidate on it.
+		std::vector<SyntaxTree::SP> tails;
+		for (size_t r = 0; r < recipes.size(); r++) 
+			if (symbol.left_recursion[r] == Grammar::Symbol::DIRECT) 
+				for (auto &a : parse_recipe(recipes[r], start_at(seed->last), 1))
+					if (a->last > seed->last) 
+						tails.push_back(a);
+
+		for (auto &tail : tails) {
+
+			SyntaxTree::SP a = (&tail == &tails.back() and grown.empty() ? seed : std::make_shared<SyntaxTree>(*seed));
+			if (tail->component.id() != target.id()) 
+				a->component = tail->component;
+			for (auto &c : tail->children) {
+				c->parent = a;
+				a->children.push_back(c);
 			}
+			a->last = tail->last;
+			grown.push_back(a);
 		}
+
+		if (grown.empty()) 
+			all_expanded_ast.push_back(seed);
+		for (auto &a : grown) 
+			all_ast.push_back(a);
 	}
 	
+	all_ast = all_expanded_ast;
+
+	debug.left_recursion[symbol.index] = outer_invocation;
+
+	if (symbol.is_weak) 
+		for (auto &ast : all_ast) 
+			reduce_weak(ast, target);
+	
 	return all_ast;
 }
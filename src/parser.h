@@ -1,9 +1,111 @@
 #pragma once
 #include <ast.h>
 
+struct ParseOptions {
+	// Large files are split at top-level statement boundaries and parsed on this many threads (1 disables it).
+	static size_t &threads() { static size_t t = 1; return t; }
+	static size_t &min_tokens_per_thread() { static size_t t = 2000; return t; }
+
+	// Work budget per file: parse() invocations and candidates returned (0: unlimited).
+	static uint64_t &max_calls() { static uint64_t m = 0; return m; }
+	static uint64_t &max_candidates() { static uint64_t m = 0; return m; }
+
+	// Function bodies are skipped over their matching braces, and only parsed when accessed.
+	static bool &lazy_function_bodies() { static bool l = false; return l; }
+	// Lazy bodies that no generated code reaches are parsed as well, to report their syntax errors.
+	static bool &check_lazy_bodies() { static bool c = false; return c; }
+
+	// Included files are parsed ahead of the Preprocessor on this many threads (0 disables it), see IncludedFiles.
+	static size_t &include_threads() { static size_t t = 1; return t; }
+};
+
+// Each included file is parsed once per compile. Tokenizing a file starts parsing the files it includes on a pool of workers,
+// and so on for the files these include, so the trees are ready, or on their way, by the time the Preprocessor gets to them.
+struct IncludedFiles {
+
+	// The canonical path of the file named by an include in from.
+	static std::string path(const SourceFile &from, const std::string &name);
+
+	// The tree of the file, shared by all its includes: each gets a copy to rewrite (see FlatSyntaxTree::Node::to_tree). 
+	// Parses it here if no worker started yet, and reports the errors of its parse.
+	static std::shared_ptr<const FlatSyntaxTree> get(const std::string &path);
+
+	// Queues the files included by the tokens of file.
+	static void prefetch(const SourceFile &file);
+};
+
+// Work done while parsing one file, shared by all the threads that parse it.
+struct ParseBudget {
+	std::atomic<uint64_t> calls = 0, candidates = 0;
+
+	bool exhausted() const { 
+		return (ParseOptions::max_calls() and calls > ParseOptions::max_calls()) or 
+		       (ParseOptions::max_candidates() and candidates > ParseOptions::max_candidates()); 
+	}
+
+	// Returns an empty pointer when no budget is set.
+	static std::shared_ptr<ParseBudget> create() {
+		if (not ParseOptions::max_calls() and not ParseOptions::max_candidates()) return std::shared_ptr<ParseBudget>();
+		return std::make_shared<ParseBudget>();
+	}
+};
+
+// Thrown by parse() when the budget is exhausted. While unwinding, the innermost invocation that did most of the work 
+// records its symbol and the tokens it went through.
+struct ParseBudgetExceeded : std::exception {
+	uint64_t calls = 0, candidates = 0;
+	bool located = false;
+	std::string symbol;
+	SyntaxTree::TI first, last;
+
+	std::string describe() const;
+	const char *what() const noexcept override { return "Parse budget exceeded"; }
+};
+
+// Opt-in parser instrumentation (--parse-stats). Each ParseDebug owns a ParseStats while enabled, and merges it into global() when done.
+struct ParseStats {
+	
+	struct Entry {
+		uint64_t calls = 0;
+		uint64_t candidates = 0;  // candidates returned to the caller
+		uint64_t discarded = 0;   // partial candidates that could not be completed
+		double seconds = 0;       // inclusive of nested calls
+		size_t max_depth = 0;
+	};
+
+	struct SymbolEntry : Entry {
+		std::vector<Entry> recipes;
+	};
+
+	std::map<std::string, SymbolEntry> symbols;
+
+	void merge(const ParseStats &other);
+	void print(std::ostream &os, bool json) const;
+
+	static bool &enabled() { static bool e = false; return e; }
+	static ParseStats &global() { static ParseStats stats; return stats; }
+};
+
 struct ParseDebug {
 	SyntaxTree::TI last_error_token;
 	std::vector<std::string> expected_targets;
+
+	std::unique_ptr<ParseStats> stats;
+	size_t depth = 0;
+
+	std::shared_ptr<ParseBudget> budget;
+	SyntaxTree::TI furthest; // furthest token looked at by the current invocation
+
+	// Per grammar symbol: the innermost position where it is being parsed, and the seed being grown there.
+	struct LeftRecursion {
+		bool active = false;
+		SyntaxTree::TI position;
+		SyntaxTree::SP seed;
+	};
+	std::vector<LeftRecursion> left_recursion;
+
+	ParseDebug() { if (ParseStats::enabled()) stats = std::make_unique<ParseStats>(); }
+	~ParseDebug() { if (stats) ParseStats::global().merge(*stats); }
 };
 
-std::vector<SyntaxTree::SP> parse(SyntaxTree::TI token_it, SyntaxTree::TI last_token, Grammar::Symbol::Component target, ParseDebug &debug,  std::vector<std::string> parent_targets_without_consuming_tokens = std::vector<std::string>(), SyntaxTree::SP parent = SyntaxTree::SP());
+std::vector<SyntaxTree::SP> parse(SyntaxTree::TI token_it, SyntaxTree::TI last_token, const Grammar::Symbol::Component &target, ParseDebug &debug, SyntaxTree::SP parent = SyntaxTree::SP());
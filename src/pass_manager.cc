@@ -0,0 +1,101 @@
+#include "pass_manager.h"
+
+#include <chrono>
+#include <algorithm>
+
+
+static void walk(SyntaxTree::SP &ast, const std::vector<const PassManager::Pass *> &group) {
+
+	SyntaxTree::traverse(ast, [&group](SyntaxTree::SP &node) {
+		for (auto &c : node->children)
+			c->parent = node;
+
+		for (auto pass : group)
+			pass->visit(node);
+	});
+}
+
+void PassManager::run(SyntaxTree::SP &ast) {
+
+	std::set<std::string> provided;
+	std::vector<bool> scheduled(passes.size(), false);
+
+	// The first pass, in the order they were added, that has not run and whose needs are provided.
+	auto next_ready = [&]() -> int {
+		for (size_t i = 0; i < passes.size(); i++) {
+			if (scheduled[i]) continue;
+			if (std::includes(provided.begin(), provided.end(), passes[i].needs.begin(), passes[i].needs.end())) return int(i);
+		}
+		return -1;
+	};
+
+	while (std::find(scheduled.begin(), scheduled.end(), false) != scheduled.end()) {
+
+		int first = next_ready();
+		if (first < 0) {
+			std::ostringstream oss;
+			for (size_t i = 0; i < passes.size(); i++)
+				if (not scheduled[i])
+					for (auto &need : passes[i].needs)
+						if (not provided.count(need)) oss << " " << passes[i].name << " needs " << need << ";";
+			Log(ERROR) << "Passes can not be ordered:" << oss.str();
+		}
+
+		std::vector<const Pass *> group(1, &passes[first]);
+		scheduled[first] = true;
+
+		if (passes[first].done) {
+			provided.insert(passes[first].provides.begin(), passes[first].provides.end());
+			if (passes[first].replay) SyntaxTree::completed_passes().push_back(passes[first].run);
+			if (after) after(passes[first].name, ast);
+			continue;
+		}
+
+		// Passes in a walk only get what was provided before it.
+		while (fuse() and group.back()->visit and not stop_after.count(group.back()->name)) {
+			int next = next_ready();
+			if (next < 0 or passes[next].done or not passes[next].visit) break;
+			group.push_back(&passes[next]);
+			scheduled[next] = true;
+		}
+
+		std::string names;
+		for (auto pass : group)
+			names += (names.empty() ? "" : "+") + pass->name;
+		Log(INFO) << "COMPILER PASS: " << names;
+
+		// recorded on errors too.
+		struct Timer {
+			std::vector<Timing> &timings;
+			std::string names;
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			~Timer() { timings.push_back({ names, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() }); }
+		};
+		{
+			Timer timer{ timings, names };
+			if (group.size() == 1)
+				group.front()->run(ast);
+			else
+				walk(ast, group);
+		}
+
+		for (auto pass : group) {
+			provided.insert(pass->provides.begin(), pass->provides.end());
+			if (pass->replay) SyntaxTree::completed_passes().push_back(pass->run);
+		}
+		for (auto pass : group)
+			if (after) after(pass->name, ast);
+	}
+}
+
+void PassManager::print_timings(std::ostream &os) const {
+
+	double total = 0;
+	for (auto &t : timings) total += t.seconds;
+
+	os << std::left << std::setw(32) << "pass" << std::right << std::setw(12) << "ms" << std::setw(8) << "%" << "\n";
+	for (auto &t : timings)
+		os << std::left << std::setw(32) << t.passes << std::right << std::fixed << std::setprecision(3) << std::setw(12) << t.seconds * 1e3
+			<< std::setprecision(1) << std::setw(8) << (total > 0 ? 100 * t.seconds / total : 0) << "\n";
+	os << std::left << std::setw(32) << "total" << std::right << std::fixed << std::setprecision(3) << std::setw(12) << total * 1e3 << "\n";
+}
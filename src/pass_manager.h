@@ -0,0 +1,45 @@
+#pragma once
+#include <ast.h>
+
+#include <set>
+
+////////////////////////////////////////////////////////////////////////
+// PASS MANAGER
+// Runs the compiler passes in an order that gives each one what it needs, and times them.
+// Consecutive passes that only handle a node before its children share a single walk of the tree.
+struct PassManager {
+
+	struct Pass {
+		std::string name;
+		std::set<std::string> needs, provides;
+
+		// Runs the pass on a tree. Also replayed on lazy nodes when they are expanded.
+		std::function<void(SyntaxTree::SP &)> run;
+
+		// Optional: handles one node, before its children are visited. It may look at the node, its parents and its children,
+		// but not at what other passes of the same walk do to them. Passes that have one can be fused.
+		std::function<void(SyntaxTree::SP &)> visit;
+
+		// Already applied to the tree (e.g., it was loaded after it), so it is only replayed on lazy nodes.
+		bool done = false;
+
+		// Replayed on lazy nodes when they are expanded. Passes that only consume the tree (e.g., print it) are not.
+		bool replay = true;
+	};
+
+	std::vector<Pass> passes;
+
+	// Passes that must end their walk, e.g. to look at the tree right after them.
+	std::set<std::string> stop_after;
+
+	// Called after each pass (done ones included), once its walk is over.
+	std::function<void(const std::string &, SyntaxTree::SP &)> after;
+
+	struct Timing { std::string passes; double seconds; };
+	std::vector<Timing> timings;
+
+	void run(SyntaxTree::SP &ast);
+	void print_timings(std::ostream &os) const;
+
+	static bool &fuse() { static bool f = true; return f; }
+};
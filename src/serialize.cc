@@ -0,0 +1,413 @@
+#include "serialize.h"
+
+#include <boost/iostreams/device/mapped_file.hpp>
+
+#include <cstring>
+#include <filesystem>
+
+
+////////////////////////////////////////////////////////////////////////
+// On disk records. All sections start at multiples of 8 bytes, and records have no implicit padding.
+namespace Binary {
+
+	constexpr char magic[8] = "MEGAAST";
+	constexpr uint32_t version = 2;
+	constexpr uint32_t none = ~uint32_t(0);
+
+	struct Header {
+		char magic[8];
+		uint32_t version;
+		uint32_t grammar; // fingerprint of the node kinds
+		uint32_t strings, string_bytes, files, tokens, nodes, children;
+	};
+
+	struct File { 
+		uint32_t path, source, first_token, tokens;
+		uint32_t source_tokens; // all the tokens of the file: more than tokens if only some were saved, none if these were not known
+		uint32_t padding;
+		uint64_t source_size, source_hash;
+	};
+
+	struct Position { uint32_t offset, line_offset, line; };
+
+	struct Token {
+		uint8_t type;
+		uint8_t flags; // 1: has_space, 2: start_of_line
+		uint8_t begin_c, end_c;
+		uint32_t literal;
+		uint64_t val;
+		Position begin, end;
+		uint32_t matching_delimiter;
+		uint32_t padding;
+	};
+
+	struct Node {
+		uint16_t kind;
+		uint8_t type; // 0: symbol, 1: token
+		uint8_t flags; // 1: is_empty, 2: is_lazy, 4: force_root, 8: must_keep
+		uint32_t id, file, first, last, children, child_count;
+	};
+
+	static_assert(sizeof(Header) == 40 and sizeof(File) == 40 and sizeof(Token) == 48 and sizeof(Node) == 28);
+
+	static size_t padded(size_t n) { return (n + 7) & ~size_t(7); }
+
+	// FNV-1a, of the sources of the files.
+	static uint64_t hash(const std::string &s) {
+		uint64_t h = 14695981039346656037ull;
+		for (auto c : s) h = (h ^ uint8_t(c)) * 1099511628211ull;
+		return h;
+	}
+
+	// FNV-1a of the kind names: trees saved with another grammar may not be valid for this one.
+	static uint32_t grammar_fingerprint() {
+		uint32_t h = 2166136261u;
+		for (auto name : kind_names)
+			for (const char *c = name; ; c++) {
+				h = (h ^ uint8_t(*c)) * 16777619u;
+				if (not *c) break;
+			}
+		return h;
+	}
+}
+
+
+void save_syntax_tree(const SyntaxTree::SP &ast, const std::string &path) {
+
+	std::vector<std::string> strings;
+	std::map<std::string, uint32_t> string_index;
+	auto intern = [&](const std::string &s) {
+		auto it = string_index.find(s);
+		if (it != string_index.end()) return it->second;
+		strings.push_back(s);
+		return string_index[s] = uint32_t(strings.size() - 1);
+	};
+
+	// Number the nodes breadth first. Shared nodes are saved once.
+	std::vector<SyntaxTree *> nodes(1, ast.get());
+	std::map<const SyntaxTree *, uint32_t> node_index = { { ast.get(), 0 } };
+	std::vector<uint32_t> children;
+	std::vector<std::pair<uint32_t, uint32_t>> children_span;
+	for (size_t i = 0; i < nodes.size(); i++) {
+		children_span.emplace_back(children.size(), nodes[i]->children.size());
+		for (auto &c : nodes[i]->children) {
+			if (not c) { children.push_back(Binary::none); continue; }
+			if (not node_index.count(c.get())) {
+				node_index[c.get()] = uint32_t(nodes.size());
+				nodes.push_back(c.get());
+			}
+			children.push_back(node_index[c.get()]);
+		}
+	}
+
+	// Files are found through the first token of nodes that span any. Then every token iterator is located in one of their token sets:
+	// the tokens of the file, or the ones loaded with a tree that saved only some of them (see SourceFile::saved_tokens), which
+	// are saved as a file record of their own.
+	struct TokenSet { const SourceFile *file; const std::vector<Token> *tokens; const std::vector<size_t> *matching_delimiters; bool complete; };
+	std::vector<const SourceFile *> source_files;
+	std::vector<TokenSet> files;
+	for (auto node : nodes) {
+		if (node->first == node->last) continue;
+		const SourceFile *file = &node->first->begin_ptr.get_file();
+		if (std::find(source_files.begin(), source_files.end(), file) != source_files.end()) continue;
+		source_files.push_back(file);
+		if (file->tokens) 
+			files.push_back({ file, file->tokens.get(), file->matching_delimiters.get(), true });
+		for (auto &saved : file->saved_tokens) 
+			files.push_back({ file, saved.get(), nullptr, false });
+	}
+
+	auto locate = [&](SyntaxTree::TI it, uint32_t &file_idx, uint32_t &token_idx) {
+		const Token *t = std::to_address(it);
+		for (size_t f = 0; f < files.size(); f++) {
+			const std::vector<Token> &tokens = *files[f].tokens;
+			if (std::less<const Token *>()(t, tokens.data()) or std::less<const Token *>()(tokens.data() + tokens.size(), t)) continue;
+			file_idx = uint32_t(f);
+			token_idx = uint32_t(t - tokens.data());
+			return;
+		}
+		Log(ERROR) << "Saving " << path << ": only trees over the tokens of their source files can be saved.";
+	};
+
+	std::vector<Binary::Node> node_records(nodes.size());
+	std::vector<std::vector<bool>> spanned(files.size());
+	for (size_t f = 0; f < files.size(); f++) 
+		spanned[f].resize(files[f].tokens->size(), false);
+
+	for (size_t i = 0; i < nodes.size(); i++) {
+
+		auto node = nodes[i];
+		auto &r = node_records[i];
+		r.kind = node->component.kind();
+		r.type = node->component.is_token();
+		r.flags = (node->is_empty ? 1 : 0) | (node->is_lazy ? 2 : 0) | (node->component.force_root ? 4 : 0) | (node->component.must_keep ? 8 : 0);
+		r.id = intern(node->component.id());
+		uint32_t last_file = 0;
+		locate(node->first, r.file, r.first);
+		locate(node->last, last_file, r.last);
+		if (last_file != r.file)
+			Log(ERROR) << "Saving " << path << ": node " << node->component.id() << " spans tokens of two files.";
+		std::fill(spanned[r.file].begin() + r.first, spanned[r.file].begin() + r.last, true);
+		r.children = children_span[i].first;
+		r.child_count = children_span[i].second;
+	}
+
+	// Tokens are renumbered to the ones saved: a token index becomes the number of saved tokens before it.
+	std::vector<std::vector<uint32_t>> saved_index(files.size());
+	for (size_t f = 0; f < files.size(); f++) {
+		saved_index[f].resize(spanned[f].size() + 1, 0);
+		for (size_t i = 0; i < spanned[f].size(); i++) 
+			saved_index[f][i + 1] = saved_index[f][i] + spanned[f][i];
+	}
+	for (auto &r : node_records) {
+		r.first = saved_index[r.file][r.first];
+		r.last = saved_index[r.file][r.last];
+	}
+
+	std::vector<Binary::File> file_records;
+	std::vector<Binary::Token> token_records;
+	for (size_t f = 0; f < files.size(); f++) {
+
+		auto file = files[f].file;
+		auto &file_tokens = *files[f].tokens;
+		Binary::File file_record;
+		std::memset(&file_record, 0, sizeof(file_record));
+		file_record.path = intern(file->path);
+		file_record.source = intern(*file->source);
+		file_record.first_token = uint32_t(token_records.size());
+		file_record.tokens = saved_index[f].back();
+		file_record.source_tokens = files[f].complete ? uint32_t(file_tokens.size()) : Binary::none;
+		file_record.source_size = file->source->size();
+		file_record.source_hash = Binary::hash(*file->source);
+		file_records.push_back(file_record);
+
+		for (size_t i = 0; i < file_tokens.size(); i++) {
+
+			if (not spanned[f][i]) continue;
+			const Token &t = file_tokens[i];
+			auto begin = t.begin_ptr.position(), end = t.end_ptr.position();
+
+			Binary::Token r;
+			std::memset(&r, 0, sizeof(r));
+			r.type = uint8_t(t.type);
+			r.flags = (t.has_space ? 1 : 0) | (t.start_of_line ? 2 : 0);
+			r.begin_c = uint8_t(begin.c);
+			r.end_c = uint8_t(end.c);
+			r.literal = intern(t.literal);
+			r.val = t.val;
+			r.begin = { begin.offset, begin.line_offset, begin.line };
+			r.end = { end.offset, end.line_offset, end.line };
+			size_t matching = files[f].matching_delimiters ? (*files[f].matching_delimiters)[i] : i;
+			r.matching_delimiter = saved_index[f][spanned[f][matching] ? matching : i];
+			token_records.push_back(r);
+		}
+	}
+
+	std::vector<uint32_t> string_offsets(1, 0);
+	for (auto &s : strings) string_offsets.push_back(string_offsets.back() + uint32_t(s.size()));
+
+	Binary::Header header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, Binary::magic, sizeof(header.magic));
+	header.version = Binary::version;
+	header.grammar = Binary::grammar_fingerprint();
+	header.strings = uint32_t(strings.size());
+	header.string_bytes = string_offsets.back();
+	header.files = uint32_t(file_records.size());
+	header.tokens = uint32_t(token_records.size());
+	header.nodes = uint32_t(node_records.size());
+	header.children = uint32_t(children.size());
+
+	std::ofstream os(path, std::ios::binary);
+	auto write = [&](const void *data, size_t size) {
+		os.write(static_cast<const char *>(data), size);
+		static const char zeros[8] = {};
+		os.write(zeros, Binary::padded(size) - size);
+	};
+	write(&header, sizeof(header));
+	write(string_offsets.data(), string_offsets.size() * sizeof(uint32_t));
+	{
+		std::string bytes;
+		for (auto &s : strings) bytes += s;
+		write(bytes.data(), bytes.size());
+	}
+	write(file_records.data(), file_records.size() * sizeof(Binary::File));
+	write(token_records.data(), token_records.size() * sizeof(Binary::Token));
+	write(node_records.data(), node_records.size() * sizeof(Binary::Node));
+	write(children.data(), children.size() * sizeof(uint32_t));
+
+	if (not os)
+		Log(ERROR) << "Could not write " << path;
+
+	Log(INFO) << "Saved " << nodes.size() << " nodes and " << token_records.size() << " tokens to " << path;
+}
+
+
+SyntaxTree::SP load_syntax_tree(const std::string &path) {
+
+	boost::iostreams::mapped_file_source mapped;
+	try {
+		mapped.open(path);
+	} catch (std::exception const &e) {
+		Log(INFO) << "Could not map " << path << ": " << e.what();
+		return SyntaxTree::SP();
+	}
+
+	auto invalid = [&](const char *reason) {
+		Log(WARNING) << "Ignoring " << path << ": " << reason;
+		return SyntaxTree::SP();
+	};
+
+	// Sections are addressed in place.
+	const char *data = mapped.data();
+	size_t size = mapped.size(), offset = 0;
+	bool truncated = false;
+	auto section = [&](size_t count, size_t record_size) {
+		const char *ret = data + offset;
+		offset += Binary::padded(count * record_size);
+		if (offset > size) truncated = true;
+		return ret;
+	};
+
+	if (size < sizeof(Binary::Header)) return invalid("not a syntax tree");
+	auto &header = *reinterpret_cast<const Binary::Header *>(section(1, sizeof(Binary::Header)));
+	if (std::memcmp(header.magic, Binary::magic, sizeof(header.magic)) or header.version != Binary::version) return invalid("not a syntax tree");
+	if (header.grammar != Binary::grammar_fingerprint()) return invalid("saved with another grammar");
+
+	auto string_offsets = reinterpret_cast<const uint32_t *>(section(header.strings + 1, sizeof(uint32_t)));
+	auto string_bytes = section(header.string_bytes, 1);
+	auto files = reinterpret_cast<const Binary::File *>(section(header.files, sizeof(Binary::File)));
+	auto tokens = reinterpret_cast<const Binary::Token *>(section(header.tokens, sizeof(Binary::Token)));
+	auto nodes = reinterpret_cast<const Binary::Node *>(section(header.nodes, sizeof(Binary::Node)));
+	auto children = reinterpret_cast<const uint32_t *>(section(header.children, sizeof(uint32_t)));
+	if (truncated or header.nodes == 0 or string_offsets[header.strings] != header.string_bytes) return invalid("truncated");
+
+	for (uint32_t i = 0; i < header.strings; i++) 
+		if (string_offsets[i] > string_offsets[i + 1]) return invalid("corrupt string");
+	for (uint32_t f = 0; f < header.files; f++) 
+		if (files[f].path >= header.strings or files[f].source >= header.strings or size_t(files[f].first_token) + files[f].tokens > header.tokens or files[f].tokens > files[f].source_tokens) return invalid("corrupt file");
+	for (uint32_t i = 0; i < header.tokens; i++) 
+		if (tokens[i].literal >= header.strings) return invalid("corrupt token");
+	for (uint32_t i = 0; i < header.nodes; i++) 
+		if (nodes[i].id >= header.strings or nodes[i].file >= header.files) return invalid("corrupt node");
+
+	// Everything that becomes an iterator or an index is checked before anything is built from it.
+	for (uint32_t f = 0; f < header.files; f++) {
+		auto &r = files[f];
+		size_t source_size = string_offsets[r.source + 1] - string_offsets[r.source];
+		for (uint32_t i = r.first_token; i < r.first_token + r.tokens; i++) {
+			auto &t = tokens[i];
+			if (t.type > Token::NUMERIC or t.matching_delimiter >= r.tokens) return invalid("corrupt token");
+			if (t.begin.offset > source_size or t.end.offset > source_size or t.begin.line_offset > t.begin.offset or t.end.line_offset > t.end.offset) return invalid("corrupt token");
+		}
+	}
+	for (uint32_t i = 0; i < header.nodes; i++) {
+		auto &r = nodes[i];
+		if (r.first > r.last or r.last > files[r.file].tokens) return invalid("corrupt node");
+		if (size_t(r.children) + r.child_count > header.children) return invalid("corrupt node");
+		for (uint32_t c = r.children; c < r.children + r.child_count; c++) 
+			if (children[c] != Binary::none and children[c] >= header.nodes) return invalid("corrupt node");
+	}
+
+	// Nodes may be shared, but a node below itself would make every walk of the tree endless.
+	{
+		std::vector<uint8_t> state(header.nodes, 0); // 0: not seen, 1: on the path from the root, 2: done
+		std::vector<std::pair<uint32_t, uint32_t>> stack(1, { 0, 0 }); // node, next child
+		state[0] = 1;
+		while (not stack.empty()) {
+			auto &[n, next] = stack.back();
+			if (next == nodes[n].child_count) {
+				state[n] = 2;
+				stack.pop_back();
+				continue;
+			}
+			uint32_t c = children[nodes[n].children + next++];
+			if (c == Binary::none or state[c] == 2) continue;
+			if (state[c] == 1) return invalid("corrupt node");
+			state[c] = 1;
+			stack.push_back({ c, 0 });
+		}
+	}
+
+	auto string = [&](uint32_t i) { return std::string_view(string_bytes + string_offsets[i], string_offsets[i + 1] - string_offsets[i]); };
+
+	// Sources must be the ones the tree was saved from. Files on disk are read from it, so a file that is included later gets 
+	// the same source as everyone else. The tokens of a file are reused if it was tokenized, and kept as its tokens if all were saved.
+	std::vector<std::shared_ptr<const std::vector<Token>>> file_tokens;
+	for (uint32_t f = 0; f < header.files; f++) {
+
+		auto &r = files[f];
+		std::string file_path(string(r.path));
+		bool on_disk = std::filesystem::exists(file_path);
+		if (on_disk and std::filesystem::file_size(file_path) != r.source_size) return invalid("source file changed");
+
+		SourceFile &file = on_disk ? SourceFile::Manager::get(file_path) : SourceFile::Manager::get(file_path, string(r.source));
+		if (file.source->size() != r.source_size or Binary::hash(*file.source) != r.source_hash) return invalid("source file changed");
+
+		bool complete = r.tokens == r.source_tokens;
+		if (complete and file.tokens and file.tokens->size() == r.tokens) {
+			file_tokens.push_back(file.tokens);
+		} else {
+
+			auto file_token_vector = std::make_shared<std::vector<Token>>();
+			auto matching_delimiters = std::make_shared<std::vector<size_t>>();
+			file_token_vector->reserve(r.tokens);
+			matching_delimiters->reserve(r.tokens);
+			for (uint32_t i = r.first_token; i < r.first_token + r.tokens; i++) {
+
+				auto &t = tokens[i];
+				NormalizedSourcePtr begin(file, { t.begin.offset, t.begin.line_offset, t.begin.line, char(t.begin_c) });
+				NormalizedSourcePtr end(file, { t.end.offset, t.end.line_offset, t.end.line, char(t.end_c) });
+				file_token_vector->emplace_back(Token::Type(t.type), std::string(string(t.literal)), begin, end, t.flags & 1, t.flags & 2);
+				file_token_vector->back().val = t.val;
+				matching_delimiters->push_back(t.matching_delimiter);
+			}
+			// Trees parsed later from the file need all of its tokens.
+			if (complete and not file.tokens) {
+				file.tokens = file_token_vector;
+				file.matching_delimiters = matching_delimiters;
+			} else {
+				file.saved_tokens.push_back(file_token_vector);
+			}
+			file_tokens.push_back(file_token_vector);
+		}
+	}
+
+	// Components are built once per id.
+	std::map<std::pair<uint32_t, uint8_t>, Grammar::Symbol::Component> components;
+
+	std::vector<SyntaxTree::SP> ret(header.nodes);
+	for (uint32_t i = 0; i < header.nodes; i++) {
+
+		auto &r = nodes[i];
+
+		auto key = std::make_pair(r.id, r.type);
+		auto it = components.find(key);
+		if (it == components.end()) {
+			std::string id(string(r.id));
+			it = components.emplace(key, r.type ? Grammar::Symbol::Component::Token(id) : Grammar::Symbol::Component::Symbol(id)).first;
+			it->second.force_root = r.flags & 4;
+			it->second.must_keep = r.flags & 8;
+		}
+
+		auto first = file_tokens[r.file]->cbegin();
+		ret[i] = std::make_shared<SyntaxTree>(first + r.first, it->second, SyntaxTree::SP());
+		ret[i]->last = first + r.last;
+		ret[i]->is_empty = r.flags & 1;
+		ret[i]->is_lazy = r.flags & 2;
+	}
+
+	for (uint32_t i = 0; i < header.nodes; i++) {
+
+		auto &r = nodes[i];
+		ret[i]->children.reserve(r.child_count);
+		for (uint32_t c = r.children; c < r.children + r.child_count; c++) {
+			ret[i]->children.push_back(children[c] == Binary::none ? SyntaxTree::SP() : ret[children[c]]);
+		}
+	}
+
+	SyntaxTree::link_parents(ret[0].get());
+
+	Log(INFO) << "Loaded " << header.nodes << " nodes and " << header.tokens << " tokens from " << path;
+	return ret[0];
+}
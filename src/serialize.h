@@ -0,0 +1,18 @@
+#pragma once
+#include <ast.h>
+
+////////////////////////////////////////////////////////////////////////
+// BINARY SYNTAX TREES
+// A tree is saved with the tokens and sources of every file it refers to, as flat arrays of fixed size records:
+// nodes (kind, component id, token span, children span), child indices, tokens (with their source positions),
+// and interned strings. Loading maps the file and checks the records in place, so nothing is tokenized or parsed again, but it 
+// still builds a Token for every saved token and a SyntaxTree node for every record: it is linear in the size of the tree, 
+// as the passes rewrite what they load right away.
+// Shared subtrees stay shared. Annotations are not saved, trees are meant to be saved right after the Preprocessor pass.
+// Only the tokens that some node spans are saved, and each file is saved with the size and hash of its source.
+
+void save_syntax_tree(const SyntaxTree::SP &ast, const std::string &path);
+
+// Returns an empty SP if path is not a saved tree of this grammar, or if one of its sources changed: on disk, or in the sources 
+// already loaded. Sources are read from disk, the saved ones are only used for the files that do not exist.
+SyntaxTree::SP load_syntax_tree(const std::string &path);
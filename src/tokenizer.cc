@@ -293,23 +293,9 @@ namespace TokenParsers {
 	}
 }
 
-std::vector<Token> &tokenize(SourceFile &file) {
-
-	NormalizedSourcePtr p(file);
-
-	// UTF-8 texts may start with a 3-byte "BOM" marker sequence.
-	// If exists, just skip them because they are useless bytes.
-	// (It is actually not recommended to add BOM markers to UTF-8
-	// texts, but it's not uncommon particularly on Windows.)
-	if ( p.starts_with("\xef\xbb\xbf") ) p += 3;
-	
-	if (Log::report_level() == EXTRA) Utilities::printSource(p);
-	
-	file.tokens = std::make_shared<std::vector<Token>>();
-	std::vector<Token> &tokens = *file.tokens;
-
-	bool start_of_line = true;
-	bool has_space = false;
+// The next token from p, skipping the comments and spaces before it, or nothing at the end of the file. 
+// has_space and start_of_line tell what was skipped since the previous token.
+static std::optional<Token> next_token(NormalizedSourcePtr &p, bool &has_space, bool &start_of_line) {
 
 	while (p) {
 		
@@ -362,11 +348,88 @@ std::vector<Token> &tokenize(SourceFile &file) {
 		has_space = false;
 		start_of_line = false;
 
-		tokens.push_back(t.value());
 		p = t.value().end_ptr;
+		return t;
+	}
+	return std::nullopt;
+}
+
+void match_delimiters(const std::vector<Token> &tokens, size_t first, size_t last, std::vector<size_t> &matching) {
+
+	std::vector<size_t> open;
+	for (size_t i = first; i < last; i++) {
+		
+		matching[i] = i;
+
+		auto &t = tokens[i];
+		if (t.type != Token::PUNCTUATOR or t.literal.size() != 1) continue;
+
+		if (t.literal == "(" or t.literal == "[" or t.literal == "{") {
+			open.push_back(i);
+			continue;
+		}
+		
+		if (t.literal != ")" and t.literal != "]" and t.literal != "}") continue;
+
+		if (open.empty()) 
+			Log(ERROR) << "Unmatched '" << t.literal << "' in line " << t.begin_ptr.get_line() << ".\n" << t.show_source();
+
+		auto &o = tokens[open.back()];
+		std::string expected = (o.literal == "(" ? ")" : o.literal == "[" ? "]" : "}");
+		if (t.literal != expected) 
+			Log(ERROR) << "Expected '" << expected << "' to close '" << o.literal << "' from line " << o.begin_ptr.get_line() 
+				<< " but found '" << t.literal << "' in line " << t.begin_ptr.get_line() << ".\n" << t.show_source();
+
+		matching[i] = open.back();
+		matching[open.back()] = i;
+		open.pop_back();
 	}
+
+	if (not open.empty()) 
+		Log(ERROR) << "Unclosed '" << tokens[open.back()].literal << "' in line " << tokens[open.back()].begin_ptr.get_line() << ".\n" << tokens[open.back()].show_source();
+}
+
+std::optional<Token> tokenize_until(NormalizedSourcePtr p, size_t stop, bool has_space, bool start_of_line, std::vector<Token> &tokens) {
+
+	while (auto t = next_token(p, has_space, start_of_line)) {
+		if (t->begin_ptr.position().offset - 1 >= stop) return t;
+		tokens.push_back(std::move(*t));
+	}
+	return std::nullopt;
+}
+
+std::vector<Token> &tokenize(SourceFile &file) {
+
+	// Trees parsed from a file keep iterators into its tokens, so a file is tokenized only once.
+	if (file.tokens) return *file.tokens;
+
+	NormalizedSourcePtr p(file);
+
+	// UTF-8 texts may start with a 3-byte "BOM" marker sequence.
+	// If exists, just skip them because they are useless bytes.
+	// (It is actually not recommended to add BOM markers to UTF-8
+	// texts, but it's not uncommon particularly on Windows.)
+	if ( p.starts_with("\xef\xbb\xbf") ) p += 3;
 	
-	if (Log::report_level() == EXTRA) Utilities::printTokens (tokens);
+	if (Log::report_level() == EXTRA) Utilities::printSource(p);
 	
+	// Both are given to the file only once tokenizing succeeded, a file that failed is tokenized again from scratch.
+	auto tokens_ptr = std::make_shared<std::vector<Token>>();
+	std::vector<Token> &tokens = *tokens_ptr;
+
+	bool start_of_line = true;
+	bool has_space = false;
+
+	while (auto t = next_token(p, has_space, start_of_line)) 
+		tokens.push_back(std::move(*t));
+
+	// Match delimiters with a stack, so consumers can skip any bracketed region in O(1).
+	auto matching_ptr = std::make_shared<std::vector<size_t>>(tokens.size());
+	match_delimiters(tokens, 0, tokens.size(), *matching_ptr);
+	
+	if (Log::report_level() == EXTRA) Utilities::printTokens (tokens);
+
+	file.tokens = tokens_ptr;
+	file.matching_delimiters = matching_ptr;
 	return tokens;
 }
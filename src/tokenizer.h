@@ -1,6 +1,7 @@
 #pragma once
 
 #include <memory>
+#include <optional>
 #include <vector>
 
 #include <file.h>
@@ -39,4 +40,14 @@ struct Token {
 	friend std::ostream& operator<<(std::ostream& os, const Token &t) { os << t.to_string(); return os; }
 };
 
+// Also fills file.matching_delimiters: for each '(', '[' or '{' the index of its closer and vice versa, 
+// and for any other token its own index. Unbalanced delimiters are reported as errors. Files already tokenized return their tokens.
 std::vector<Token> &tokenize(SourceFile &file);
+
+// Appends to tokens those of the file from p, up to the first one that starts at or after the byte offset stop, which is returned 
+// (nothing at the end of the file). has_space and start_of_line tell what lies between p and the previous token. 
+// Used to tokenize an edited region again, see SyntaxTree::reparse: nothing is given to the file.
+std::optional<Token> tokenize_until(NormalizedSourcePtr p, size_t stop, bool has_space, bool start_of_line, std::vector<Token> &tokens);
+
+// Fills matching[first, last) for tokens[first, last) as tokenize() does, and reports their unbalanced delimiters as errors.
+void match_delimiters(const std::vector<Token> &tokens, size_t first, size_t last, std::vector<size_t> &matching);
@@ -0,0 +1,259 @@
+////////////////////////////////////////////////////////////////////////
+// Generates the node kinds (grammar_kinds.h), the typed AST views (grammar_views.h) and the pass visitor (grammar_visitor.h) from grammar.y.
+// Run by the Makefile: grammar_views kinds|views|visitor > header
+
+#include "grammar.h"
+
+#include <algorithm>
+
+static bool is_identifier(const std::string &s) {
+
+	if (s.empty() or std::isdigit(s.front())) return false;
+	for (char c : s)
+		if (not std::isalnum(c) and c != '_') return false;
+	return true;
+}
+
+// C++ name of a node kind: symbols keep their name, reserved words get a kw_ prefix, and punctuators are spelled out.
+static std::string mangle(const Grammar &grammar, const std::string &id) {
+
+	if (is_identifier(id))
+		return (grammar.reserved_keywords.count(id) ? "kw_" : "") + id;
+
+	static const std::map<char, std::string> names = {
+		{'+', "plus"}, {'-', "minus"}, {'*', "star"}, {'/', "slash"}, {'%', "percent"}, {'=', "eq"}, {'<', "lt"}, {'>', "gt"},
+		{'!', "not"}, {'&', "amp"}, {'|', "pipe"}, {'^', "caret"}, {'~', "tilde"}, {'?', "question"}, {':', "colon"}, {';', "semicolon"},
+		{',', "comma"}, {'.', "dot"}, {'(', "lparen"}, {')', "rparen"}, {'[', "lbracket"}, {']', "rbracket"}, {'{', "lbrace"}, {'}', "rbrace"},
+		{'#', "hash"},
+	};
+	std::string ret = "op";
+	for (char c : id) {
+		if (not names.count(c)) Log(ERROR) << "No name for '" << c << "' in node kind " << id;
+		ret += "_" + names.at(c);
+	}
+	return ret;
+}
+
+static std::string camel_case(const Grammar &grammar, const std::string &id) {
+
+	std::string ret;
+	bool upper = true;
+	for (char c : (is_identifier(id) ? id : mangle(grammar, id))) {
+		if (c == '_') { upper = true; continue; }
+		ret += (upper ? char(std::toupper(c)) : c);
+		upper = false;
+	}
+	return ret;
+}
+
+static void emit_kinds(const Grammar &grammar, std::ostream &os) {
+
+	os << "// Generated from grammar.y by src/tools/grammar_views.cc. Do not edit.\n";
+	os << "#pragma once\n\n";
+	os << "#include <cstdint>\n#include <cstddef>\n\n";
+	os << "enum class Kind : uint16_t {\n";
+	os << "\tNONE = 0,\n";
+	for (size_t i = 1; i < grammar.kind_names.size(); i++)
+		os << "\t" << mangle(grammar, grammar.kind_names[i]) << " = " << i << ",\n";
+	os << "};\n\n";
+	os << "constexpr size_t kind_count = " << grammar.kind_names.size() << ";\n\n";
+	os << "constexpr const char *kind_names[kind_count] = {\n";
+	for (auto &name : grammar.kind_names) {
+		std::string escaped;
+		for (char c : name) {
+			if (c == '"' or c == '\\') escaped += '\\';
+			escaped += c;
+		}
+		os << "\t\"" << escaped << "\",\n";
+	}
+	os << "};\n";
+}
+
+// The children a node gets from a recipe, named after their grammar component.
+// Tokens are dropped unless kept, and a %root component gives its kind to the node.
+struct Layout {
+	std::string kind;
+	std::vector<std::string> slots;
+};
+
+static std::map<std::string, std::vector<Layout>> layouts(const Grammar &grammar) {
+
+	std::map<std::string, std::vector<Layout>> ret;
+	for (auto symbol : grammar.symbol_list) {
+
+		if (symbol->is_list) continue;
+
+		for (auto &recipe : symbol->recipes) {
+
+			Layout layout{ symbol->name, {} };
+			bool known = true;
+			for (auto &c : recipe) {
+				if (c.force_root) {
+					layout.kind = c.id();
+					// the children of a rooted symbol are spliced in, so their number is not known here.
+					if (c.is_symbol() and c.index() >= 0) known = false;
+				} else if (c.is_symbol() or c.must_keep) {
+					layout.slots.push_back(c.id());
+				}
+			}
+
+			// %weak symbols with less than two children are removed while parsing.
+			if (not known or (symbol->is_weak and layout.kind == symbol->name and layout.slots.size() < 2)) continue;
+
+			auto &kind_layouts = ret[layout.kind];
+			if (std::none_of(kind_layouts.begin(), kind_layouts.end(), [&](auto &l) { return l.slots == layout.slots; }))
+				kind_layouts.push_back(layout);
+		}
+	}
+	return ret;
+}
+
+static void emit_views(const Grammar &grammar, std::ostream &os) {
+
+	os << "// Generated from grammar.y by src/tools/grammar_views.cc. Do not edit.\n";
+	os << "#pragma once\n\n";
+	os << "#include <ast.h>\n\n";
+	os << "namespace AST {\n\n";
+	os << "// A view checks the kind of its node, and names its children after the grammar components that produced them.\n";
+	os << "// Children of %weak components may have been reduced to one of their own children.\n";
+	os << "struct View {\n";
+	os << "\tSyntaxTree::SP &ast;\n";
+	os << "\tView(SyntaxTree::SP &ast_, Kind kind) : ast(ast_) {\n";
+	os << "\t\tif (ast.kind() != kind) ast.log(ERROR) << \"Expected \" << kind_names[size_t(kind)] << \" but found \" << ast.id() << \". \\n\";\n";
+	os << "\t}\n";
+	os << "};\n";
+
+	std::set<std::string> lists;
+	for (auto symbol : grammar.symbol_list)
+		if (symbol->is_list) lists.insert(symbol->name);
+
+	auto all_layouts = layouts(grammar);
+	for (auto &name : lists) all_layouts[name];
+
+	for (auto &[kind, kind_layouts] : all_layouts) {
+
+		bool is_list = lists.count(kind);
+		if (not is_list and std::all_of(kind_layouts.begin(), kind_layouts.end(), [](auto &l) { return l.slots.empty(); })) continue;
+
+		std::string view = camel_case(grammar, kind);
+		std::string kind_enum = "Kind::" + mangle(grammar, kind);
+
+		os << "\n";
+		for (auto &l : kind_layouts) {
+			os << "// " << kind << " :";
+			for (auto &s : l.slots) os << " " << s;
+			os << "\n";
+		}
+		os << "struct " << view << " : View {\n";
+		os << "\t" << view << "(SyntaxTree::SP &ast_) : View(ast_, " << kind_enum << ") {}\n";
+
+		if (is_list) {
+			os << "\tstd::vector<SyntaxTree::SP> &items() { return ast->children; }\n";
+			os << "};\n";
+			continue;
+		}
+
+		// Layouts are told apart by their number of children, so accessors need distinct sizes unless they sit at the same index in all of them.
+		std::set<size_t> sizes;
+		for (auto &l : kind_layouts) sizes.insert(l.slots.size());
+		bool distinct_sizes = (sizes.size() == kind_layouts.size());
+
+		// accessor name -> (layout size -> index)
+		std::map<std::string, std::map<size_t, size_t>> accessors;
+		std::vector<std::string> order;
+		for (auto &l : kind_layouts) {
+			std::map<std::string, int> seen;
+			for (size_t i = 0; i < l.slots.size(); i++) {
+				std::string name = mangle(grammar, l.slots[i]);
+				if (seen[name]++) { name += "_"; name += std::to_string(seen[name]); }
+				if (not accessors.count(name)) order.push_back(name);
+				accessors[name][l.slots.size()] = i;
+			}
+		}
+
+		std::vector<std::string> skipped;
+		for (auto &name : order) {
+
+			auto &positions = accessors[name];
+			std::set<size_t> indices;
+			for (auto &p : positions) indices.insert(p.second);
+			bool in_all = (positions.size() == kind_layouts.size());
+
+			if (not (in_all and indices.size() == 1) and not distinct_sizes) {
+				skipped.push_back(name);
+				continue;
+			}
+
+			if (not in_all) {
+				os << "\tbool has_" << name << "() const { size_t n = ast->children.size(); return";
+				for (auto &p : positions) os << (&p == &*positions.begin() ? " " : " or ") << "n == " << p.first;
+				os << "; }\n";
+			}
+
+			if (indices.size() == 1) {
+				os << "\tSyntaxTree::SP &" << name << "() { return ast[" << *indices.begin() << "]; }\n";
+			} else {
+				os << "\tSyntaxTree::SP &" << name << "() {\n";
+				os << "\t\tswitch (ast->children.size()) {\n";
+				for (auto &p : positions)
+					os << "\t\t\tcase " << p.first << ": return ast[" << p.second << "];\n";
+				os << "\t\t}\n";
+				os << "\t\tast.log(ERROR) << \"" << name << " not found in " << kind << ". \\n\"; throw;\n";
+				os << "\t}\n";
+			}
+		}
+		if (not skipped.empty()) {
+			os << "\t// Not generated, their index does not follow from the number of children:";
+			for (auto &name : skipped) os << " " << name;
+			os << "\n";
+		}
+		os << "};\n";
+	}
+	os << "\n}\n";
+}
+
+static void emit_visitor(const Grammar &grammar, std::ostream &os) {
+
+	os << "// Generated from grammar.y by src/tools/grammar_views.cc. Do not edit.\n";
+	os << "#pragma once\n\n";
+	os << "#include <ast.h>\n\n";
+	os << "namespace AST {\n\n";
+	os << "// Dispatches a node to Derived::on_<kind>(ast), resolved at compile time, so handlers can be inlined.\n";
+	os << "// Kinds Derived has no handler for go to Derived::otherwise(ast).\n";
+	os << "template<typename Derived>\n";
+	os << "struct Visitor {\n\n";
+	os << "\tvoid dispatch(SyntaxTree::SP &ast) {\n";
+	os << "\t\tswitch (ast.kind()) {\n";
+	os << "\t\t\tcase Kind::NONE: return derived().otherwise(ast);\n";
+	for (size_t i = 1; i < grammar.kind_names.size(); i++) {
+		std::string name = mangle(grammar, grammar.kind_names[i]);
+		os << "\t\t\tcase Kind::" << name << ": return derived().on_" << name << "(ast);\n";
+	}
+	os << "\t\t}\n";
+	os << "\t\tderived().otherwise(ast);\n";
+	os << "\t}\n\n";
+	os << "\tvoid otherwise(SyntaxTree::SP &) {}\n\n";
+	for (size_t i = 1; i < grammar.kind_names.size(); i++) 
+		os << "\tvoid on_" << mangle(grammar, grammar.kind_names[i]) << "(SyntaxTree::SP &ast) { derived().otherwise(ast); }\n";
+	os << "\nprivate:\n";
+	os << "\tDerived &derived() { return static_cast<Derived &>(*this); }\n";
+	os << "};\n\n}\n";
+}
+
+int main(int argc, char *argv[]) {
+
+	std::string what = (argc == 2 ? argv[1] : "");
+
+	Grammar grammar;
+	if (what == "kinds") {
+		emit_kinds(grammar, std::cout);
+	} else if (what == "views") {
+		emit_views(grammar, std::cout);
+	} else if (what == "visitor") {
+		emit_visitor(grammar, std::cout);
+	} else {
+		std::cerr << "Usage: " << argv[0] << " kinds|views|visitor" << std::endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,179 @@
+#include "types.h"
+#include <grammar_views.h>
+
+#include <tuple>
+#include <algorithm>
+
+
+std::string Type::c_name() const {
+
+	if (type_class == VOID) return "void";
+	if (type_class == INTEGER) return (is_signed ? "int" : "uint") + std::to_string(size * 8) + "_t";
+	return "";
+}
+
+std::string Type::to_string() const {
+
+	std::ostringstream oss;
+	switch (type_class) {
+		case VOID: oss << "void"; break;
+		case INTEGER: oss << (is_signed ? "int" : "uint") << size * 8; break;
+		case ARRAY: oss << element->to_string() << "["; if (count) oss << count; oss << "]"; break;
+		case BIT_FIELD: oss << element->to_string() << " : " << count; break;
+		case FUNCTION:
+			oss << "function[" << element->to_string() << "(";
+			for (auto &p : params) oss << (&p == &params.front() ? "" : ", ") << p->to_string();
+			oss << ")]";
+			break;
+		case STRUCT: case UNION:
+			oss << (type_class == STRUCT ? "struct" : "union") << " {";
+			for (auto &m : members) oss << " " << m.type->to_string() << " " << m.name << ";";
+			oss << " }";
+			break;
+	}
+	return oss.str();
+}
+
+bool TypeTable::Key::operator<(const Key &k) const {
+	return std::tie(type_class, is_signed, size, count, element, params, members, declaration) < 
+		std::tie(k.type_class, k.is_signed, k.size, k.count, k.element, k.params, k.members, k.declaration);
+}
+
+const Type *TypeTable::intern(Type type) {
+
+	Key key{ type.type_class, type.is_signed, type.size, type.count, type.element, type.params, {}, type.declaration };
+	for (auto &m : type.members)
+		key.members.emplace_back(m.name, m.type);
+
+	auto &t = types[key];
+	if (not t) t = std::make_unique<Type>(std::move(type));
+	return t.get();
+}
+
+const Type *TypeTable::void_type() { return intern(Type(Type::VOID)); }
+
+// The target (a Z80) reads any type at any address, so alignments are all 1. Aggregates still take theirs from their members.
+const Type *TypeTable::integer(uint32_t bits, bool is_signed) {
+
+	if (bits != 8 and bits != 16)
+		Log(ERROR) << "There are no " << bits << " bit integers";
+
+	Type type(Type::INTEGER);
+	type.is_signed = is_signed;
+	type.size = bits / 8;
+	return intern(type);
+}
+
+const Type *TypeTable::array(const Type *element, uint32_t count) {
+
+	Type type(Type::ARRAY);
+	type.element = element;
+	type.count = count;
+	type.size = element->size * count;
+	type.align = element->align;
+	return intern(type);
+}
+
+const Type *TypeTable::function(const Type *ret, const std::vector<const Type *> &params) {
+
+	Type type(Type::FUNCTION);
+	type.element = ret;
+	type.params = params;
+	return intern(type);
+}
+
+const Type *TypeTable::bit_field(const Type *integer, uint32_t bits) {
+
+	if (integer->type_class != Type::INTEGER or bits == 0 or bits > integer->size * 8)
+		Log(ERROR) << "A bit field of " << bits << " bits does not fit in " << integer->to_string();
+
+	Type type(Type::BIT_FIELD);
+	type.element = integer;
+	type.count = bits;
+	type.size = integer->size;
+	type.align = integer->align;
+	return intern(type);
+}
+
+// Bit fields are not packed (yet): each takes the whole integer that holds it.
+const Type *TypeTable::structure(Type::Class type_class, const std::vector<Type::Member> &members, const SyntaxTree *declaration) {
+
+	Type type(type_class);
+	type.declaration = declaration;
+	for (auto m : members) {
+		type.align = std::max(type.align, m.type->align);
+		if (type_class == Type::STRUCT) {
+			m.offset = (type.size + m.type->align - 1) / m.type->align * m.type->align;
+			type.size = m.offset + m.type->size;
+		} else {
+			m.offset = 0;
+			type.size = std::max(type.size, m.type->size);
+		}
+		type.members.push_back(m);
+	}
+	type.size = (type.size + type.align - 1) / type.align * type.align;
+	return intern(type);
+}
+
+const Type *TypeTable::of(SyntaxTree::SP &ast) {
+
+	if (ast->annotations and ast->resolved_type()) return ast->resolved_type();
+
+	const Type *type = nullptr;
+	Kind kind = ast.kind();
+
+	// Attributes belong to what is declared, not to its type.
+	if (kind == Kind::type_name and not ast->children.empty()) type = of(ast[0]);
+	if (kind == Kind::function_return_type) type = of(AST::FunctionReturnType(ast).type_name());
+	if (kind == Kind::template_instance and ast->annotations and ast->type()) type = of(ast->type());
+
+	if (kind == Kind::kw_void) type = void_type();
+	if (kind == Kind::kw_uint8) type = integer(8, false);
+	if (kind == Kind::kw_int8) type = integer(8, true);
+	if (kind == Kind::kw_uint16) type = integer(16, false);
+	if (kind == Kind::kw_int16) type = integer(16, true);
+
+	if (kind == Kind::array) {
+		AST::Array array_ast(ast);
+		if (auto element = of(array_ast.type_name()))
+			type = array(element, array_ast.has_CONSTANT() ? uint32_t(array_ast.CONSTANT()->first->val) : 0);
+	}
+
+	if (kind == Kind::bit_field) {
+		AST::BitField bit_field_ast(ast);
+		if (auto holder = of(bit_field_ast.type_name()))
+			type = bit_field(holder, uint32_t(bit_field_ast.CONSTANT()->first->val));
+	}
+
+	if (kind == Kind::function_declaration) {
+		AST::FunctionDeclaration declaration(ast);
+		auto ret = of(declaration.function_return_type());
+		std::vector<const Type *> params;
+		auto &param_list = declaration.function_parameter_list_scoped();
+		if (param_list.kind() == Kind::function_parameter_list)
+			for (auto &p : AST::FunctionParameterList(param_list).items())
+				params.push_back(of(AST::FunctionParameterDeclaration(p).type_name()));
+		if (ret and std::find(params.begin(), params.end(), nullptr) == params.end())
+			type = function(ret, params);
+	}
+
+	if (kind == Kind::kw_struct or kind == Kind::kw_union) {
+		// Only the variables declared in them are members.
+		std::vector<Type::Member> members;
+		bool resolved = true;
+		if (not ast->children.empty())
+			for (auto &declaration : ast[0]->children) {
+				if (declaration.kind() != Kind::type_declaration) continue;
+				AST::TypeDeclaration type_declaration(declaration);
+				auto member_type = of(type_declaration.type_name());
+				resolved = resolved and member_type;
+				for (auto &item : AST::InitDeclaratorList(type_declaration.init_declarator_list()).items())
+					members.push_back({ item.kind() == Kind::op_eq ? item[0].literal() : item.literal(), member_type, 0 });
+			}
+		if (resolved)
+			type = structure(kind == Kind::kw_struct ? Type::STRUCT : Type::UNION, members, ast.get());
+	}
+
+	ast->resolved_type() = type;
+	return type;
+}
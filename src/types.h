@@ -0,0 +1,67 @@
+#pragma once
+#include <ast.h>
+
+////////////////////////////////////////////////////////////////////////
+// TYPES
+// Types are interned in a TypeTable, which holds one canonical Type for each distinct type. Two types are the same if and only if
+// their pointers are equal, and their size, alignment and member offsets are computed once, when they are first built.
+// Structs and unions are nominal, as in C: each is its own type, named by the node that declares it, whatever its members.
+struct Type {
+
+	enum Class : uint8_t { VOID, INTEGER, ARRAY, STRUCT, UNION, FUNCTION, BIT_FIELD };
+
+	struct Member { std::string name; const Type *type; uint32_t offset; };
+
+	Class type_class;
+	bool is_signed = false;           // INTEGER
+	uint32_t size = 0, align = 1;     // in bytes
+	uint32_t count = 0;               // ARRAY: number of elements, 0 if it is not given. BIT_FIELD: width in bits
+	const Type *element = nullptr;    // ARRAY: element type. FUNCTION: return type. BIT_FIELD: the integer that holds it
+	std::vector<const Type *> params; // FUNCTION
+	std::vector<Member> members;      // STRUCT, UNION
+	const SyntaxTree *declaration = nullptr; // STRUCT, UNION
+
+	explicit Type(Class type_class_) : type_class(type_class_) {}
+
+	// The C spelling of void and the integers, empty for the rest.
+	std::string c_name() const;
+
+	// In MegaC syntax
+	std::string to_string() const;
+};
+
+struct TypeTable {
+
+	const Type *void_type();
+	const Type *integer(uint32_t bits, bool is_signed);
+	const Type *array(const Type *element, uint32_t count);
+	const Type *function(const Type *ret, const std::vector<const Type *> &params);
+	const Type *bit_field(const Type *integer, uint32_t bits);
+	// Lays the members out, so their offsets do not need to be given.
+	const Type *structure(Type::Class type_class, const std::vector<Type::Member> &members, const SyntaxTree *declaration);
+
+	// The type of a type_name, or of any node below one that denotes a type. Remembered in its annotations, see resolved_type().
+	// nullptr for types that can not be resolved here (yet): names of types, and typeof.
+	const Type *of(SyntaxTree::SP &ast);
+
+	size_t size() const { return types.size(); }
+
+	// The types of the current compile.
+	static TypeTable &global() { static TypeTable table; return table; }
+
+private:
+	struct Key {
+		Type::Class type_class;
+		bool is_signed;
+		uint32_t size, count;
+		const Type *element;
+		std::vector<const Type *> params;
+		std::vector<std::pair<std::string, const Type *>> members;
+		const SyntaxTree *declaration;
+		bool operator<(const Key &k) const;
+	};
+
+	std::map<Key, std::unique_ptr<Type>> types;
+
+	const Type *intern(Type type);
+};